@@ -0,0 +1,117 @@
+#!/bin/sh
+#
+# End-to-end benchmark of sdwriter: write and verify synthetic images
+# to simulated, file and loop device targets, with various options.
+# For every run, print throughput and CPU time.
+#
+# Use:
+#       make bench
+#       BENCH_SIZE=1G ./bench.sh
+#
+# Loop device targets need root access; without it, they are skipped.
+# On the loop device, --bench is checked to leave the data intact.
+# On the simulated target, --adapt is checked to reduce the request size.
+#
+SDWRITER=${SDWRITER:-./sdwriter}
+MKIMAGE=${MKIMAGE:-./mkimage}
+SIZE=${BENCH_SIZE:-256M}
+DIR=${BENCH_DIR:-${TMPDIR:-/tmp}/sdwriter-bench.$$}
+LOOP=
+
+cleanup()
+{
+    [ -n "$LOOP" ] && losetup -d $LOOP
+    rm -rf "$DIR"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+mkdir -p "$DIR" || exit 1
+
+# Synthetic images: name and options of mkimage.
+images="random:
+zero50:-z 50 -l clustered
+zero90:-z 90 -l tail
+text:-c 75
+mixed:-z 30 -l scattered -c 50"
+
+# Targets.
+targets="null:
+sim:bw=200M,lat=100us
+file:$DIR/target.img"
+if [ "$(id -u)" = 0 ] && command -v losetup >/dev/null; then
+    truncate -s $SIZE "$DIR/loop.img"
+    LOOP=$(losetup -f --show "$DIR/loop.img") && targets="$targets
+$LOOP"
+fi
+
+# Options of sdwriter.
+options="
+--flush-mb 0
+--adapt"
+
+# Run sdwriter and print one line of results.
+run()
+{
+    image=$1 target=$2 opts=$3 mode=$4
+    case $target in
+    file:*) label=file: ;;
+    *)      label=$target ;;
+    esac
+    out=$($SDWRITER -s $mode $opts -d $target "$DIR/$image.img" 2>&1) || {
+        echo "$out" >&2
+        printf "%-8s %-24s %-14s %-6s failed\n" $image $label "$opts" ${mode:-write}
+        return
+    }
+    echo "$out" | awk -v image=$image -v target=$label -v opts="$opts" -v mode=${mode:-write} '
+        /Speed:/        { speed = $2 }
+        /cpu user/      { user = $3 }
+        /cpu system/    { sys = $3 }
+        END { printf "%-8s %-24s %-14s %-6s %8s %8s %8s\n",
+                image, target, opts, mode, speed, user, sys }'
+}
+
+printf "%-8s %-24s %-14s %-6s %8s %8s %8s\n" \
+    Image Target Options Mode MB/sec User Sys
+echo "$images" | while IFS=: read name args; do
+    $MKIMAGE -s $SIZE $args "$DIR/$name.img" || exit 1
+    echo "$targets" | while read target; do
+        echo "$options" | while read opts; do
+            run $name $target "$opts"
+        done
+        case $target in
+        null:*|sim:*) ;;
+        *) run $name $target "" -v ;;
+        esac
+    done
+    rm -f "$DIR/$name.img"
+done
+
+# With --adapt, stalls of the simulated target must reduce the request size.
+$MKIMAGE -s 32M "$DIR/adapt.img" || exit 1
+out=$($SDWRITER --adapt --stall-ms 100 -d sim:bw=200M,stall=300ms/8M "$DIR/adapt.img" 2>&1)
+if ! echo "$out" | grep -q "Reduce request size"; then
+    echo "$out" >&2
+    echo "Option --adapt did not reduce the request size"
+    exit 1
+fi
+echo "Option --adapt: request size reduced on stalls"
+rm -f "$DIR/adapt.img"
+
+# Benchmark of the loop device must put back the data of the scratch region.
+if [ -n "$LOOP" ]; then
+    $MKIMAGE -s $SIZE "$DIR/random.img" &&
+    $SDWRITER -d $LOOP "$DIR/random.img" >/dev/null 2>&1 || exit 1
+    before=$(cksum < $LOOP)
+    for opts in "" --random; do
+        out=$($SDWRITER --bench $opts --qd 2 -d $LOOP 2>&1) || {
+            echo "$out" >&2
+            echo "Benchmark ${opts:-sequential} of $LOOP failed"
+            exit 1
+        }
+        if [ "$(cksum < $LOOP)" != "$before" ]; then
+            echo "Benchmark ${opts:-sequential} of $LOOP did not restore the data"
+            exit 1
+        fi
+        echo "Benchmark ${opts:-sequential} of $LOOP: data restored"
+    done
+fi
@@ -0,0 +1,497 @@
+/*
+ * Data-path kernels of sdwriter, with variants for instruction sets.
+ * Variants for x86 are compiled with target attributes, so no special
+ * compiler options are needed; the choice is made at run time.
+ *
+ * Copyright (C) 2015 Serge Vakulenko
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <stdio.h>
+#include <string.h>
+#include "kernels.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#   define HAVE_X86
+#   include <immintrin.h>
+#endif
+
+zero_check_t *zero_check;
+block_compare_t *block_compare;
+crc32c_t *crc32c;
+sha256_blocks_t *sha256_blocks;
+
+/*
+ * Load a 64-bit word from unaligned address.
+ */
+static inline uint64_t load64(const unsigned char *p)
+{
+    uint64_t x;
+
+    memcpy(&x, p, 8);
+    return x;
+}
+
+/*
+ * Zero check, portable: by 64-bit words, 64 bytes per step.
+ */
+static int zero_check_scalar(const void *buf, size_t nbytes)
+{
+    const unsigned char *p = buf;
+    size_t i = 0;
+
+    for (; i + 64 <= nbytes; i += 64) {
+        if ((load64(p+i)    | load64(p+i+8)  | load64(p+i+16) | load64(p+i+24) |
+             load64(p+i+32) | load64(p+i+40) | load64(p+i+48) | load64(p+i+56)) != 0)
+            return 0;
+    }
+    for (; i < nbytes; i++) {
+        if (p[i] != 0)
+            return 0;
+    }
+    return 1;
+}
+
+/*
+ * Compare, portable: by 64-bit words, then find the byte.
+ */
+static size_t block_compare_scalar(const void *a, const void *b, size_t nbytes)
+{
+    const unsigned char *p = a, *q = b;
+    size_t i = 0;
+
+    for (; i + 8 <= nbytes; i += 8) {
+        if (load64(p+i) != load64(q+i))
+            break;
+    }
+    for (; i < nbytes; i++) {
+        if (p[i] != q[i])
+            break;
+    }
+    return i;
+}
+
+/*
+ * CRC32C, portable: slicing by 8 bytes.
+ */
+static uint32_t crc32c_table[8][256];
+
+static void crc32c_init_table()
+{
+    uint32_t crc;
+    unsigned i, k;
+
+    for (i=0; i<256; i++) {
+        crc = i;
+        for (k=0; k<8; k++)
+            crc = (crc >> 1) ^ (0x82f63b78 & -(crc & 1));
+        crc32c_table[0][i] = crc;
+    }
+    for (i=0; i<256; i++) {
+        crc = crc32c_table[0][i];
+        for (k=1; k<8; k++) {
+            crc = crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+            crc32c_table[k][i] = crc;
+        }
+    }
+}
+
+static uint32_t crc32c_scalar(uint32_t crc, const void *buf, size_t nbytes)
+{
+    const unsigned char *p = buf;
+
+    crc = ~crc;
+    for (; nbytes >= 8; nbytes -= 8, p += 8) {
+        uint64_t x = load64(p) ^ crc;
+
+        crc = crc32c_table[7][x & 0xff] ^
+              crc32c_table[6][(x >> 8) & 0xff] ^
+              crc32c_table[5][(x >> 16) & 0xff] ^
+              crc32c_table[4][(x >> 24) & 0xff] ^
+              crc32c_table[3][(x >> 32) & 0xff] ^
+              crc32c_table[2][(x >> 40) & 0xff] ^
+              crc32c_table[1][(x >> 48) & 0xff] ^
+              crc32c_table[0][x >> 56];
+    }
+    for (; nbytes > 0; nbytes--)
+        crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+/*
+ * SHA-256, portable.
+ */
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROR(x, n)   (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_blocks_scalar(uint32_t state[8], const void *data, size_t nblocks)
+{
+    const unsigned char *p = data;
+    uint32_t w[64], a, b, c, d, e, f, g, h, t1, t2;
+    unsigned i;
+
+    for (; nblocks > 0; nblocks--, p += 64) {
+        for (i=0; i<16; i++)
+            w[i] = (uint32_t) p[4*i] << 24 | p[4*i+1] << 16 | p[4*i+2] << 8 | p[4*i+3];
+        for (i=16; i<64; i++)
+            w[i] = (ROR(w[i-2], 17) ^ ROR(w[i-2], 19) ^ (w[i-2] >> 10)) + w[i-7] +
+                   (ROR(w[i-15], 7) ^ ROR(w[i-15], 18) ^ (w[i-15] >> 3)) + w[i-16];
+
+        a = state[0]; b = state[1]; c = state[2]; d = state[3];
+        e = state[4]; f = state[5]; g = state[6]; h = state[7];
+        for (i=0; i<64; i++) {
+            t1 = h + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25)) + ((e & f) ^ (~e & g)) +
+                 sha256_k[i] + w[i];
+            t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+    }
+}
+
+#ifdef HAVE_X86
+static int have_sse2()      { return __builtin_cpu_supports("sse2"); }
+static int have_sse42()     { return __builtin_cpu_supports("sse4.2"); }
+static int have_avx2()      { return __builtin_cpu_supports("avx2"); }
+static int have_avx512bw()  { return __builtin_cpu_supports("avx512bw"); }
+static int have_sha()       { return __builtin_cpu_supports("sha") &&
+                                     __builtin_cpu_supports("sse4.1"); }
+
+/*
+ * Zero check, SSE2: 64 bytes per step.
+ */
+__attribute__((target("sse2")))
+static int zero_check_sse2(const void *buf, size_t nbytes)
+{
+    const unsigned char *p = buf;
+    size_t i = 0;
+
+    for (; i + 64 <= nbytes; i += 64) {
+        __m128i v = _mm_or_si128(
+            _mm_or_si128(_mm_loadu_si128((const __m128i*) (p+i)),
+                         _mm_loadu_si128((const __m128i*) (p+i+16))),
+            _mm_or_si128(_mm_loadu_si128((const __m128i*) (p+i+32)),
+                         _mm_loadu_si128((const __m128i*) (p+i+48))));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) != 0xffff)
+            return 0;
+    }
+    return zero_check_scalar(p + i, nbytes - i);
+}
+
+/*
+ * Zero check, AVX2: 128 bytes per step.
+ */
+__attribute__((target("avx2")))
+static int zero_check_avx2(const void *buf, size_t nbytes)
+{
+    const unsigned char *p = buf;
+    size_t i = 0;
+
+    for (; i + 128 <= nbytes; i += 128) {
+        __m256i v = _mm256_or_si256(
+            _mm256_or_si256(_mm256_loadu_si256((const __m256i*) (p+i)),
+                            _mm256_loadu_si256((const __m256i*) (p+i+32))),
+            _mm256_or_si256(_mm256_loadu_si256((const __m256i*) (p+i+64)),
+                            _mm256_loadu_si256((const __m256i*) (p+i+96))));
+        if (! _mm256_testz_si256(v, v))
+            return 0;
+    }
+    return zero_check_scalar(p + i, nbytes - i);
+}
+
+/*
+ * Zero check, AVX-512: 256 bytes per step.
+ */
+__attribute__((target("avx512f,avx512bw")))
+static int zero_check_avx512(const void *buf, size_t nbytes)
+{
+    const unsigned char *p = buf;
+    size_t i = 0;
+
+    for (; i + 256 <= nbytes; i += 256) {
+        __m512i v = _mm512_or_si512(
+            _mm512_or_si512(_mm512_loadu_si512(p+i), _mm512_loadu_si512(p+i+64)),
+            _mm512_or_si512(_mm512_loadu_si512(p+i+128), _mm512_loadu_si512(p+i+192)));
+        if (_mm512_test_epi64_mask(v, v) != 0)
+            return 0;
+    }
+    return zero_check_scalar(p + i, nbytes - i);
+}
+
+/*
+ * Compare, SSE2: 16 bytes per step.
+ */
+__attribute__((target("sse2")))
+static size_t block_compare_sse2(const void *a, const void *b, size_t nbytes)
+{
+    const unsigned char *p = a, *q = b;
+    size_t i = 0;
+
+    for (; i + 16 <= nbytes; i += 16) {
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(
+            _mm_loadu_si128((const __m128i*) (p+i)),
+            _mm_loadu_si128((const __m128i*) (q+i))));
+        if (mask != 0xffff)
+            return i + __builtin_ctz(~mask);
+    }
+    return i + block_compare_scalar(p + i, q + i, nbytes - i);
+}
+
+/*
+ * Compare, AVX2: 32 bytes per step.
+ */
+__attribute__((target("avx2")))
+static size_t block_compare_avx2(const void *a, const void *b, size_t nbytes)
+{
+    const unsigned char *p = a, *q = b;
+    size_t i = 0;
+
+    for (; i + 32 <= nbytes; i += 32) {
+        unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(
+            _mm256_loadu_si256((const __m256i*) (p+i)),
+            _mm256_loadu_si256((const __m256i*) (q+i))));
+        if (mask != 0xffffffff)
+            return i + __builtin_ctz(~mask);
+    }
+    return i + block_compare_scalar(p + i, q + i, nbytes - i);
+}
+
+/*
+ * Compare, AVX-512: 64 bytes per step.
+ */
+__attribute__((target("avx512f,avx512bw")))
+static size_t block_compare_avx512(const void *a, const void *b, size_t nbytes)
+{
+    const unsigned char *p = a, *q = b;
+    size_t i = 0;
+
+    for (; i + 64 <= nbytes; i += 64) {
+        __mmask64 mask = _mm512_cmpneq_epi8_mask(_mm512_loadu_si512(p+i),
+                                                 _mm512_loadu_si512(q+i));
+        if (mask != 0)
+            return i + __builtin_ctzll(mask);
+    }
+    return i + block_compare_scalar(p + i, q + i, nbytes - i);
+}
+
+/*
+ * CRC32C, SSE4.2: crc32 instruction.
+ */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const void *buf, size_t nbytes)
+{
+    const unsigned char *p = buf;
+
+    crc = ~crc;
+#ifdef __x86_64__
+    uint64_t crc64 = crc;
+
+    for (; nbytes >= 8; nbytes -= 8, p += 8)
+        crc64 = _mm_crc32_u64(crc64, load64(p));
+    crc = crc64;
+#endif
+    for (; nbytes >= 4; nbytes -= 4, p += 4) {
+        uint32_t x;
+
+        memcpy(&x, p, 4);
+        crc = _mm_crc32_u32(crc, x);
+    }
+    for (; nbytes > 0; nbytes--)
+        crc = _mm_crc32_u8(crc, *p++);
+    return ~crc;
+}
+
+/*
+ * SHA-256, SHA extensions.  State is kept as ABEF and CDGH
+ * halves; every sha256rnds2 makes two rounds.
+ */
+__attribute__((target("sha,sse4.1")))
+static void sha256_blocks_shani(uint32_t state[8], const void *data, size_t nblocks)
+{
+    const unsigned char *p = data;
+    const __m128i shuffle = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i state0, state1, save0, save1, tmp, msg, w[4];
+    unsigned i;
+
+    tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*) &state[0]), 0xb1);
+    state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*) &state[4]), 0x1b);
+    state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xf0);
+
+    for (; nblocks > 0; nblocks--, p += 64) {
+        save0 = state0;
+        save1 = state1;
+        for (i=0; i<16; i++) {
+            if (i < 4) {
+                w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (p + 16*i)), shuffle);
+            } else {
+                /* W[i] from W[i-4] ... W[i-1]. */
+                tmp = _mm_alignr_epi8(w[(i-1) % 4], w[(i-2) % 4], 4);
+                w[i % 4] = _mm_sha256msg2_epu32(
+                    _mm_add_epi32(_mm_sha256msg1_epu32(w[i % 4], w[(i-3) % 4]), tmp),
+                    w[(i-1) % 4]);
+            }
+            msg = _mm_add_epi32(w[i % 4], _mm_loadu_si128((const __m128i*) &sha256_k[4*i]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0e));
+        }
+        state0 = _mm_add_epi32(state0, save0);
+        state1 = _mm_add_epi32(state1, save1);
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1b);
+    state1 = _mm_shuffle_epi32(state1, 0xb1);
+    _mm_storeu_si128((__m128i*) &state[0], _mm_blend_epi16(tmp, state1, 0xf0));
+    _mm_storeu_si128((__m128i*) &state[4], _mm_alignr_epi8(state1, tmp, 8));
+}
+#endif /* HAVE_X86 */
+
+const struct kernel kernel_table[] = {
+    { "zero_check",    "scalar",  0,              zero_check_scalar },
+#ifdef HAVE_X86
+    { "zero_check",    "sse2",    have_sse2,      zero_check_sse2 },
+    { "zero_check",    "avx2",    have_avx2,      zero_check_avx2 },
+    { "zero_check",    "avx512",  have_avx512bw,  zero_check_avx512 },
+#endif
+    { "block_compare", "scalar",  0,              block_compare_scalar },
+#ifdef HAVE_X86
+    { "block_compare", "sse2",    have_sse2,      block_compare_sse2 },
+    { "block_compare", "avx2",    have_avx2,      block_compare_avx2 },
+    { "block_compare", "avx512",  have_avx512bw,  block_compare_avx512 },
+#endif
+    { "crc32c",        "scalar",  0,              crc32c_scalar },
+#ifdef HAVE_X86
+    { "crc32c",        "sse4.2",  have_sse42,     crc32c_sse42 },
+#endif
+    { "sha256",        "scalar",  0,              sha256_blocks_scalar },
+#ifdef HAVE_X86
+    { "sha256",        "sha-ni",  have_sha,       sha256_blocks_shani },
+#endif
+    { 0 },
+};
+
+/*
+ * Find the fastest variant of the kernel, supported by the CPU.
+ */
+const struct kernel *kernel_selected(const char *name)
+{
+    const struct kernel *k, *best = 0;
+
+    for (k=kernel_table; k->name; k++) {
+        if (strcmp(k->name, name) == 0 && (! k->supported || k->supported()))
+            best = k;
+    }
+    return best;
+}
+
+/*
+ * Select variants of all kernels.
+ */
+void kernels_init()
+{
+#ifdef HAVE_X86
+    __builtin_cpu_init();
+#endif
+    crc32c_init_table();
+    zero_check = (zero_check_t*) kernel_selected("zero_check")->func;
+    block_compare = (block_compare_t*) kernel_selected("block_compare")->func;
+    crc32c = (crc32c_t*) kernel_selected("crc32c")->func;
+    sha256_blocks = (sha256_blocks_t*) kernel_selected("sha256")->func;
+}
+
+/*
+ * Start SHA-256 of a stream.
+ */
+void sha256_init(struct sha256 *ctx)
+{
+    static const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+
+    memcpy(ctx->state, initial, sizeof(initial));
+    ctx->length = 0;
+}
+
+/*
+ * Add data to SHA-256 of a stream.
+ */
+void sha256_update(struct sha256 *ctx, const void *data, size_t nbytes)
+{
+    const unsigned char *p = data;
+    unsigned used = ctx->length % 64;
+
+    ctx->length += nbytes;
+    if (used > 0) {
+        unsigned n = (nbytes < 64 - used) ? nbytes : 64 - used;
+
+        memcpy(ctx->buf + used, p, n);
+        p += n;
+        nbytes -= n;
+        if (used + n < 64)
+            return;
+        sha256_blocks(ctx->state, ctx->buf, 1);
+    }
+    if (nbytes >= 64) {
+        sha256_blocks(ctx->state, p, nbytes / 64);
+        p += nbytes / 64 * 64;
+        nbytes %= 64;
+    }
+    memcpy(ctx->buf, p, nbytes);
+}
+
+/*
+ * Finish SHA-256 of a stream, get the digest.
+ */
+void sha256_final(struct sha256 *ctx, unsigned char digest[32])
+{
+    uint64_t bits = ctx->length * 8;
+    unsigned used = ctx->length % 64, i;
+
+    ctx->buf[used++] = 0x80;
+    if (used > 56) {
+        memset(ctx->buf + used, 0, 64 - used);
+        sha256_blocks(ctx->state, ctx->buf, 1);
+        used = 0;
+    }
+    memset(ctx->buf + used, 0, 56 - used);
+    for (i=0; i<8; i++)
+        ctx->buf[56 + i] = bits >> (56 - 8*i);
+    sha256_blocks(ctx->state, ctx->buf, 1);
+
+    for (i=0; i<32; i++)
+        digest[i] = ctx->state[i/4] >> (24 - 8*(i%4));
+}
+
+/*
+ * Convert the digest to hex string.
+ */
+void sha256_hex(const unsigned char digest[32], char hex[65])
+{
+    unsigned i;
+
+    for (i=0; i<32; i++)
+        sprintf(hex + 2*i, "%02x", digest[i]);
+}
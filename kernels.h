@@ -0,0 +1,83 @@
+/*
+ * Data-path kernels of sdwriter, with variants for instruction sets.
+ *
+ * Copyright (C) 2015 Serge Vakulenko
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Check whether the buffer contains only zeros.
+ */
+typedef int zero_check_t(const void *buf, size_t nbytes);
+
+/*
+ * Compare two buffers.  Return offset of the first mismatch,
+ * or nbytes when the buffers are equal.
+ */
+typedef size_t block_compare_t(const void *a, const void *b, size_t nbytes);
+
+/*
+ * Update CRC32C (Castagnoli) of the data.  Start with crc = 0.
+ */
+typedef uint32_t crc32c_t(uint32_t crc, const void *buf, size_t nbytes);
+
+/*
+ * Process 64-byte blocks of SHA-256.
+ */
+typedef void sha256_blocks_t(uint32_t state[8], const void *data, size_t nblocks);
+
+/*
+ * Variant of a kernel.  In the table, variants of every kernel
+ * follow from slow to fast: the last one, supported by the CPU, is used.
+ */
+struct kernel {
+    const char *name;           /* Name of the kernel */
+    const char *isa;            /* Instruction set */
+    int (*supported)(void);     /* Check the CPU, or NULL for any */
+    void *func;                 /* Implementation */
+};
+
+extern const struct kernel kernel_table[]; /* Terminated by NULL name */
+
+/*
+ * Selected variants.  Call kernels_init() before use.
+ */
+extern zero_check_t *zero_check;
+extern block_compare_t *block_compare;
+extern crc32c_t *crc32c;
+extern sha256_blocks_t *sha256_blocks;
+
+void kernels_init(void);
+const struct kernel *kernel_selected(const char *name);
+
+/*
+ * SHA-256 of a stream.
+ */
+struct sha256 {
+    uint32_t state[8];
+    uint64_t length;            /* Bytes processed */
+    unsigned char buf[64];      /* Partial block */
+};
+
+void sha256_init(struct sha256 *ctx);
+void sha256_update(struct sha256 *ctx, const void *data, size_t nbytes);
+void sha256_final(struct sha256 *ctx, unsigned char digest[32]);
+void sha256_hex(const unsigned char digest[32], char hex[65]);
+
+#endif
@@ -0,0 +1,179 @@
+/*
+ * microbench - measure throughput of data-path kernels of sdwriter,
+ * for every variant supported by this CPU.
+ *
+ * Copyright (C) 2015 Serge Vakulenko
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "kernels.h"
+
+unsigned buf_size = 1024*1024;  /* Size of data buffer */
+unsigned run_msec = 200;        /* Duration of one measurement */
+volatile size_t sink;           /* Keeps results alive */
+
+/*
+ * Get a monotonic time stamp in nanoseconds.
+ */
+unsigned long long timestamp_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Run the kernel on the buffer once.
+ * Buffer a holds zeros, b random data, and c a copy of b.
+ */
+void run_kernel(const struct kernel *k, const char *a, const char *b,
+    const char *c)
+{
+    if (strcmp(k->name, "zero_check") == 0) {
+        sink += ((zero_check_t*) k->func)(a, buf_size);
+    } else if (strcmp(k->name, "block_compare") == 0) {
+        sink += ((block_compare_t*) k->func)(b, c, buf_size);
+    } else if (strcmp(k->name, "crc32c") == 0) {
+        sink += ((crc32c_t*) k->func)(0, b, buf_size);
+    } else if (strcmp(k->name, "sha256") == 0) {
+        uint32_t state[8] = { 0 };
+
+        ((sha256_blocks_t*) k->func)(state, b, buf_size / 64);
+        sink += state[0];
+    }
+}
+
+/*
+ * Check the variant against the portable one on the same data.
+ */
+int check_kernel(const struct kernel *k, const struct kernel *ref,
+    char *a, char *b)
+{
+    if (strcmp(k->name, "zero_check") == 0) {
+        int ok = ((zero_check_t*) k->func)(a, buf_size) == 1;
+
+        a[buf_size - 1] = 1;
+        ok &= ((zero_check_t*) k->func)(a, buf_size) == 0;
+        a[buf_size - 1] = 0;
+        return ok;
+    }
+    if (strcmp(k->name, "block_compare") == 0) {
+        size_t pos = buf_size - 37, result;
+
+        memcpy(a, b, buf_size);
+        a[pos] ^= 1;
+        result = ((block_compare_t*) k->func)(a, b, buf_size);
+        memset(a, 0, buf_size);
+        return result == pos;
+    }
+    if (strcmp(k->name, "crc32c") == 0)
+        return ((crc32c_t*) k->func)(0, "123456789", 9) == 0xe3069283 &&
+               ((crc32c_t*) k->func)(0, b + 3, buf_size - 3) ==
+               ((crc32c_t*) ref->func)(0, b + 3, buf_size - 3);
+    if (strcmp(k->name, "sha256") == 0) {
+        uint32_t s1[8] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+        uint32_t s2[8] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+
+        ((sha256_blocks_t*) k->func)(s1, b, buf_size / 64);
+        ((sha256_blocks_t*) ref->func)(s2, b, buf_size / 64);
+        return memcmp(s1, s2, sizeof(s1)) == 0;
+    }
+    return 1;
+}
+
+/*
+ * Print usage information, then terminate the program.
+ */
+void usage()
+{
+    printf("Microbenchmark of sdwriter kernels\n");
+    printf("Usage:\n");
+    printf("       microbench [-s size] [-t msec]\n");
+    printf("\nOptions:\n");
+    printf("       -s size             Size of data buffer, kbytes (default 1024)\n");
+    printf("       -t msec             Duration of one measurement (default 200)\n");
+    exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+    const struct kernel *k, *ref = 0;
+    char *a, *b, *c;
+    unsigned i;
+    int ch, failed = 0;
+
+    while ((ch = getopt(argc, argv, "s:t:h")) != -1) {
+        switch (ch) {
+        case 's':
+            buf_size = strtoul(optarg, 0, 0) * 1024;
+            if (buf_size < 1024)
+                usage();
+            continue;
+        case 't':
+            run_msec = strtoul(optarg, 0, 0);
+            continue;
+        }
+        usage();
+    }
+    kernels_init();
+
+    /* Zeros in one buffer, random data in two others. */
+    a = calloc(1, buf_size);
+    b = malloc(buf_size);
+    c = malloc(buf_size);
+    if (! a || ! b || ! c) {
+        fprintf(stderr, "Out of memory\n");
+        exit(-1);
+    }
+    for (i=0; i<buf_size; i++)
+        b[i] = rand();
+    memcpy(c, b, buf_size);
+
+    printf("Buffer %u kbytes, %u msec per kernel\n\n", buf_size / 1024, run_msec);
+    printf("%-14s %-8s %8s\n", "Kernel", "ISA", "GB/sec");
+    for (k=kernel_table; k->name; k++) {
+        unsigned long long t0, elapsed, count = 0;
+
+        if (! ref || strcmp(ref->name, k->name) != 0)
+            ref = k;
+        if (k->supported && ! k->supported()) {
+            printf("%-14s %-8s %8s\n", k->name, k->isa, "-");
+            continue;
+        }
+        if (! check_kernel(k, ref, a, b)) {
+            printf("%-14s %-8s %8s\n", k->name, k->isa, "WRONG");
+            failed++;
+            continue;
+        }
+
+        /* Warm up, then run for the given time. */
+        run_kernel(k, a, b, c);
+        t0 = timestamp_ns();
+        do {
+            run_kernel(k, a, b, c);
+            count++;
+            elapsed = timestamp_ns() - t0;
+        } while (elapsed < run_msec * 1000000ULL);
+
+        printf("%-14s %-8s %8.2f%s\n", k->name, k->isa,
+            (double) count * buf_size / elapsed,
+            (k == kernel_selected(k->name)) ? "  selected" : "");
+    }
+    return failed ? -1 : 0;
+}
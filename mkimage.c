@@ -0,0 +1,248 @@
+/*
+ * mkimage - generate synthetic disk images for benchmarking of sdwriter.
+ *
+ * Copyright (C) 2015 Serge Vakulenko
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+
+#ifndef O_BINARY
+#   define O_BINARY 0
+#endif
+
+/*
+ * Layout of zero blocks in the image.
+ */
+enum {
+    LAYOUT_SCATTERED,           /* Zero blocks at random */
+    LAYOUT_CLUSTERED,           /* Zero blocks in runs, like a file system */
+    LAYOUT_TAIL,                /* All zero blocks at the end */
+};
+
+unsigned long long image_size = 64*1024*1024; /* Size of the image */
+unsigned block_size = 64*1024;  /* Unit of the layout */
+double zero_ratio;              /* Fraction of zero blocks */
+double compress_ratio;          /* Fraction of compressible data in a block */
+int layout = LAYOUT_SCATTERED;  /* Layout of zero blocks */
+unsigned cluster = 64;          /* Blocks in a run, for clustered layout */
+uint64_t seed = 1;              /* Seed of pseudo-random generator */
+
+/*
+ * Pseudo-random generator: xorshift64.
+ */
+uint64_t xorshift(uint64_t *state)
+{
+    uint64_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+/*
+ * Get a random number in range 0...1.
+ */
+double uniform(uint64_t *state)
+{
+    return (xorshift(state) >> 11) * (1.0 / (1ULL << 53));
+}
+
+/*
+ * Parse a size with optional suffix K, M, G or T, like "64M".
+ */
+unsigned long long parse_size(const char *str)
+{
+    char *end;
+    unsigned long long value = strtoull(str, &end, 0);
+
+    switch (*end) {
+    case 'T': case 't': value <<= 10; /* fall through */
+    case 'G': case 'g': value <<= 10; /* fall through */
+    case 'M': case 'm': value <<= 10; /* fall through */
+    case 'K': case 'k': value <<= 10;
+        ++end;
+    }
+    if (*end != 0 || value == 0) {
+        fprintf(stderr, "%s: Bad size\n", str);
+        exit(-1);
+    }
+    return value;
+}
+
+/*
+ * Parse a percentage, like "50".
+ */
+double parse_percent(const char *str)
+{
+    double value = strtod(str, 0);
+
+    if (value < 0 || value > 100) {
+        fprintf(stderr, "%s: Percent must be 0 to 100\n", str);
+        exit(-1);
+    }
+    return value / 100;
+}
+
+/*
+ * Decide whether the block is zero.
+ */
+int is_zero_block(unsigned long long index, unsigned long long nblocks,
+    uint64_t *state)
+{
+    static int run_zero;
+    static unsigned run_left;
+
+    switch (layout) {
+    case LAYOUT_TAIL:
+        return index >= nblocks - (unsigned long long) (nblocks * zero_ratio);
+    case LAYOUT_CLUSTERED:
+        /* Runs of blocks of the same kind, with mean length of cluster. */
+        if (run_left == 0) {
+            run_zero = uniform(state) < zero_ratio;
+            run_left = 1 + xorshift(state) % (2 * cluster);
+        }
+        run_left--;
+        return run_zero;
+    default:
+        return uniform(state) < zero_ratio;
+    }
+}
+
+/*
+ * Fill a data block: compressible part is text-like,
+ * with a small alphabet and repeats, the rest is random.
+ */
+void fill_block(char *buf, unsigned nbytes, uint64_t *state)
+{
+    unsigned compressible = nbytes * compress_ratio;
+    unsigned i;
+    uint64_t x;
+
+    for (i=0; i<compressible; i++) {
+        if (i % 64 == 0)
+            x = xorshift(state);
+        buf[i] = "etaoin shrdlu\n"[(x >> (i % 64 / 4 * 4)) % 14];
+    }
+    for (; i<nbytes; i+=8) {
+        x = xorshift(state);
+        memcpy(buf + i, &x, (nbytes - i < 8) ? nbytes - i : 8);
+    }
+}
+
+/*
+ * Print usage information, then terminate the program.
+ */
+void usage()
+{
+    printf("Generator of synthetic disk images\n");
+    printf("Usage:\n");
+    printf("       mkimage [options] file.img\n");
+    printf("\nOptions:\n");
+    printf("       -s size             Size of the image (default 64M)\n");
+    printf("       -z percent          Fraction of zero blocks (default 0)\n");
+    printf("       -c percent          Compressible part of data blocks (default 0)\n");
+    printf("       -l layout           Layout of zero blocks: scattered, clustered or tail\n");
+    printf("       -b size             Size of block (default 64K)\n");
+    printf("       -r seed             Seed of random generator (default 1)\n");
+    printf("\nZero blocks are left as holes, so the image is a sparse file.\n");
+    exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *filename;
+    unsigned long long nblocks, i, offset;
+    uint64_t state;
+    char *buf;
+    int fd, ch;
+
+    while ((ch = getopt(argc, argv, "s:z:c:l:b:r:h")) != -1) {
+        switch (ch) {
+        case 's':
+            image_size = parse_size(optarg);
+            continue;
+        case 'z':
+            zero_ratio = parse_percent(optarg);
+            continue;
+        case 'c':
+            compress_ratio = parse_percent(optarg);
+            continue;
+        case 'l':
+            if (strcmp(optarg, "scattered") == 0)
+                layout = LAYOUT_SCATTERED;
+            else if (strcmp(optarg, "clustered") == 0)
+                layout = LAYOUT_CLUSTERED;
+            else if (strcmp(optarg, "tail") == 0)
+                layout = LAYOUT_TAIL;
+            else
+                usage();
+            continue;
+        case 'b':
+            block_size = parse_size(optarg);
+            continue;
+        case 'r':
+            seed = strtoull(optarg, 0, 0);
+            continue;
+        }
+        usage();
+    }
+    argc -= optind;
+    argv += optind;
+    if (argc != 1)
+        usage();
+    filename = argv[0];
+
+    fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+    if (fd < 0) {
+        perror(filename);
+        exit(-1);
+    }
+    buf = malloc(block_size);
+    if (! buf) {
+        fprintf(stderr, "Out of memory\n");
+        exit(-1);
+    }
+
+    state = seed ? seed : 1;
+    nblocks = (image_size + block_size - 1) / block_size;
+    for (i=0; i<nblocks; i++) {
+        unsigned n = block_size;
+
+        offset = i * block_size;
+        if (n > image_size - offset)
+            n = image_size - offset;
+        if (is_zero_block(i, nblocks, &state))
+            continue;
+
+        fill_block(buf, n, &state);
+        if (pwrite(fd, buf, n, offset) != n) {
+            perror(filename);
+            exit(-1);
+        }
+    }
+    if (ftruncate(fd, image_size) < 0 || close(fd) < 0) {
+        perror(filename);
+        exit(-1);
+    }
+    free(buf);
+    return 0;
+}
@@ -15,6 +15,9 @@
  * See the License for the specific language governing permissions and
  * limitations under the License.
  */
+#ifdef __linux__
+#   define _GNU_SOURCE          /* for O_DIRECT */
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -22,15 +25,32 @@
 #include <unistd.h>
 #include <signal.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/stat.h>
 #include <getopt.h>
+#include <pthread.h>
+#include "kernels.h"
 
 #ifdef __linux__
+#   include <sys/ioctl.h>
+#   include <sys/resource.h>
+#   include <sys/wait.h>
+#   include <sys/file.h>
+#   include <sys/mount.h>
+#   include <linux/fs.h>
+#   include <sys/sysmacros.h>
 #   include <libudev.h>
 #endif
 
 #ifdef __APPLE__
+#   include <sys/ioctl.h>
+#   include <sys/resource.h>
+#   include <sys/wait.h>
+#   include <sys/file.h>
+#   include <sys/disk.h>
 #   include <CoreFoundation/CoreFoundation.h>
 #   include <IOKit/IOBSD.h>
 #   include <IOKit/storage/IOMedia.h>
@@ -44,6 +64,26 @@
 #   define fsync(fd)    FlushFileBuffers((HANDLE) _get_osfhandle(fd))
 #endif
 
+/*
+ * Static probes for tracing with bpftrace or SystemTap, like:
+ *      bpftrace -e 'usdt:./sdwriter:sdwriter:write_complete { @[arg3 / 1000] = count(); }'
+ * Without <sys/sdt.h>, probes compile to nothing: arguments are not
+ * evaluated.  With it, every probe is a single NOP instruction until
+ * a tracer attaches.
+ */
+#ifdef HAVE_SYS_SDT_H
+#   include <sys/sdt.h>
+#   define PROBE1(name, a)             DTRACE_PROBE1(sdwriter, name, a)
+#   define PROBE3(name, a, b, c)       DTRACE_PROBE3(sdwriter, name, a, b, c)
+#   define PROBE4(name, a, b, c, d)    DTRACE_PROBE4(sdwriter, name, a, b, c, d)
+#else
+#   define PROBE1(name, a)             ((void) sizeof(a))
+#   define PROBE3(name, a, b, c)       ((void) sizeof(a), (void) sizeof(b), \
+                                         (void) sizeof(c))
+#   define PROBE4(name, a, b, c, d)    ((void) sizeof(a), (void) sizeof(b), \
+                                         (void) sizeof(c), (void) sizeof(d))
+#endif
+
 #ifdef GITCOUNT
 #   define VERSION      "1.0."GITCOUNT
 #else
@@ -54,659 +94,4714 @@
 #   define O_BINARY     0
 #endif
 
+#define MAXDEV 9                /* Max number of listed devices */
+#define MAX_REQUEST (16*1024*1024) /* Max size of read/write requests */
+
+/*
+ * Information about a target disk device.
+ */
+struct device_info {
+    char devnode[256];          /* Path to device node */
+    char desc[1024];            /* Human readable description */
+    unsigned long long size;    /* Size in bytes */
+    char vendor[128];           /* Vendor name */
+    char product[128];          /* Product name */
+    char serial[128];           /* Serial number */
+    char bus[8];                /* Bus type: "usb" or "mmc" */
+    unsigned link_mbps;         /* USB link speed, Mbit/sec */
+    char usb_version[8];        /* USB version, like "2.00" */
+    char bus_timing[160];       /* MMC bus timing */
+    char cid[40];               /* SD card identification register, hex */
+    char csd[40];               /* SD card specific data register, hex */
+    char date[16];              /* SD card manufacturing date, like "09/2019" */
+    unsigned speed_class;       /* SD speed class: 2, 4, 6 or 10 */
+    unsigned uhs_grade;         /* UHS speed grade: U1 or U3 */
+    unsigned video_class;       /* Video speed class: V6...V90 */
+    unsigned app_class;         /* Application performance class: A1 or A2 */
+    unsigned au_size;           /* Allocation unit size, bytes */
+    unsigned logical_block;     /* Logical block size, bytes */
+    unsigned physical_block;    /* Physical block size, bytes */
+    unsigned max_sectors_kb;    /* Max request size, kbytes */
+    unsigned max_hw_sectors_kb; /* Max request size allowed by hardware */
+    unsigned nr_requests;       /* Queue depth */
+    unsigned long long discard_max; /* Max discard size, zero when unsupported */
+    int mounted;                /* Number of mounted partitions */
+    int rotational;             /* Rotational media */
+};
+
 const char *device_name;        /* Optional name of target device */
+unsigned long long device_id;   /* Device number of target, for probes */
+struct device_info target_info; /* Properties of target device, when known */
+double min_rate;                /* Refuse links slower than this, MB/sec */
+unsigned block_size = 32*1024;  /* Size of read/write requests */
+unsigned long long flush_interval = 16*1024*1024; /* Flush after this many bytes */
 int verify_only;                /* Verify-only option */
+int list_only;                  /* List devices and exit */
+int no_unmount;                 /* Refuse to write to mounted device */
+int json_output;                /* Print device list in JSON format */
 int debug_level;
+int print_stats;                /* Print latency statistics */
+const char *series_filename;    /* Export throughput time series to this file */
+int progress_fd = -1;           /* Report progress in JSON to this descriptor */
+unsigned stall_msec = 1000;     /* Report requests slower than this */
+int adaptive;                   /* Reduce request size on stalls */
+unsigned retry_max = 5;         /* Retries of a failed request */
+int retry_split;                /* Retry failed request by smaller pieces */
+const char *metrics_filename;   /* Prometheus textfile with metrics */
+int bench_mode;                 /* Benchmark the device */
+unsigned long long bench_size = 64*1024*1024; /* Benchmark region, 0 - whole disk */
+int destructive;                /* Benchmark may destroy the data */
+const char *report_filename;    /* Save benchmark results in JSON */
+int resume_mode;                /* Continue the write from the journal */
+int resume_verify;              /* Verify the last window before resuming */
+const char *journal_filename;   /* Checkpoint journal of the write */
+int scan_mode;                  /* Read scan of the whole disk */
+const char *map_filename;       /* Save the scan map to CSV file */
+int capacity_check;             /* Check for fake capacity */
+int capture_mode;               /* Read the disk into image file */
+const char *compress_method;    /* Compress captured image: zstd or xz */
+int bench_random;               /* Random 4K benchmark, instead of sequential */
+unsigned bench_qd = 32;         /* Max queue depth of benchmark */
+volatile int bench_stop;        /* Benchmark interrupted */
+volatile int bench_restore;     /* Saved data must be written back */
+volatile sig_atomic_t interrupt_signal; /* Signal, handled by the main loop */
 const char *progname;
-unsigned progress_count;
 const char copyright[] = "Copyright (C) 2015 Serge Vakulenko";
 
+void monitor_stop();
+void metrics_finish(int ok);
+void journal_finish(int ok);
+
 /*
  * Terminate the program with a proper status.
  */
 void quit(int ok)
 {
+    monitor_stop();
+    journal_finish(ok);
+    metrics_finish(ok);
     exit(ok ? 0 : -1);
 }
 
 /*
- * Signal handler.
+ * Signal handler.  Only set a flag: the main loop terminates
+ * the program, when no locks are held.
  */
 void interrupted(int signum)
 {
-    fprintf(stderr, "\nInterrupted.\n");
-    quit(0);
+    static const char msg[] = "\nInterrupted.\n";
+    static const char restore_msg[] = "\nInterrupted, restoring the data.\n";
+
+    /* Let the benchmark put the saved data back. */
+    if (bench_restore)
+        write(2, restore_msg, sizeof(restore_msg) - 1);
+    else
+        write(2, msg, sizeof(msg) - 1);
+    interrupt_signal = signum;
+    bench_stop = 1;
+}
+
+/*
+ * Terminate the program, when interrupted by a signal.
+ * Called from the main thread only.
+ */
+void check_interrupt()
+{
+    if (interrupt_signal)
+        quit(0);
 }
 
 /*
- * Compute a time interval elapsed since t0, in microseconds.
+ * Install the signal handler.  Blocking system calls are not restarted,
+ * so that the main thread can notice the signal.
  */
-unsigned mseconds_elapsed(struct timeval *t0)
+void catch_signal(int signum)
 {
-    struct timeval t1;
-    unsigned mseconds;
+#ifdef MINGW32
+    signal(signum, interrupted);
+#else
+    struct sigaction sa;
 
-    gettimeofday(&t1, 0);
-    mseconds = (t1.tv_sec - t0->tv_sec) * 1000 +
-        (t1.tv_usec - t0->tv_usec) / 1000;
-    if (mseconds < 1)
-        mseconds = 1;
-    return mseconds;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = interrupted;
+    sigemptyset(&sa.sa_mask);
+    sigaction(signum, &sa, 0);
+#endif
 }
 
 /*
- * Get a list of SD card devices.
+ * Create a thread with signals blocked: they are delivered
+ * to the main thread only.
  */
-void get_devices(char *devtab[], int maxdev)
+int thread_create(pthread_t *thread, void *(*func)(void*), void *arg)
 {
-    int ndev = 0;
+#ifdef MINGW32
+    return pthread_create(thread, 0, func, arg);
+#else
+    sigset_t mask, old;
+    int result;
 
-#if defined(__linux__)
-    /*
-     * Create the udev object.
-     */
-    struct udev *udev = udev_new();
-    if (! udev) {
-        printf("Can't create udev\n");
-        quit(0);
-    }
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, &old);
+    result = pthread_create(thread, 0, func, arg);
+    pthread_sigmask(SIG_SETMASK, &old, 0);
+    return result;
+#endif
+}
 
-    /*
-     * Create a list of the devices in the 'block' subsystem.
-     */
-    struct udev_enumerate *enumerate = udev_enumerate_new(udev);
-    udev_enumerate_add_match_subsystem(enumerate, "block");
-    udev_enumerate_scan_devices(enumerate);
+/*
+ * Get a monotonic time stamp in nanoseconds.
+ */
+unsigned long long timestamp_ns()
+{
+#ifdef MINGW32
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER now;
 
-    struct udev_list_entry *devices = udev_enumerate_get_list_entry(enumerate);
+    if (! freq.QuadPart)
+        QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (unsigned long long) (now.QuadPart / (double) freq.QuadPart * 1e9);
+#else
+    struct timespec ts;
 
-    /*
-     * For each item enumerated, print out its information.
-     */
-    struct udev_list_entry *dev_list_entry;
-    udev_list_entry_foreach(dev_list_entry, devices) {
-        if (ndev >= maxdev)
-            break;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
 
-        /*
-         * Get the filename of the /sys entry for the device
-         * and create a udev_device object (dev) representing it.
-         */
-        const char *path = udev_list_entry_get_name(dev_list_entry);
-        struct udev_device *dev = udev_device_new_from_syspath(udev, path);
+/*
+ * Latency histogram with log-linear buckets, like HdrHistogram:
+ * values below 16 ns get a bucket each, and every next power of two
+ * is split into 16 linear sub-buckets.  Relative error is below 6%.
+ */
+#define HIST_SUB_BITS   4
+#define HIST_SUB        (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS   42              /* Up to 73 minutes */
+#define HIST_NBUCKETS   ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
 
-        /*
-         * Get the parent device with the subsystem/devtype pair
-         * of "usb"/"usb_device".
-         */
-        struct udev_device *usb = udev_device_get_parent_with_subsystem_devtype(dev,
-               "usb", "usb_device");
-        if (! usb) {
-            //printf("Unable to find parent usb device.\n");
-            continue;
-        }
+struct histogram {
+    const char *name;                   /* Name of the phase */
+    unsigned long long count;           /* Number of samples */
+    unsigned long long total;           /* Sum of all samples, ns */
+    unsigned long long max;             /* Max sample, ns */
+    unsigned long long bucket[HIST_NBUCKETS];
+};
 
-        /* Get the 'removable' attribute. */
-        const char *removable = udev_device_get_sysattr_value(dev, "removable");
-        if (! removable || *removable != '1') {
-            continue;
-        }
+struct histogram hist_write   = { .name = "write" };
+struct histogram hist_flush   = { .name = "flush" };
+struct histogram hist_read    = { .name = "read" };
+struct histogram hist_source  = { .name = "source" };
+struct histogram hist_compare = { .name = "compare" };
 
-        /* Get the disk size in 512-byte blocks. */
-        unsigned size = strtoul(udev_device_get_sysattr_value(dev, "size"), 0, 0);
-        if (size == 0) {
-            /* SD reader without SD card inserted. */
-            continue;
-        }
+/*
+ * Get a bucket index for the value.
+ */
+unsigned hist_index(unsigned long long value)
+{
+    int msb;
 
-        /* Get the path to the device node in /dev. */
-        const char *devpath = udev_device_get_devnode(dev);
+    if (value < HIST_SUB)
+        return value;
+    msb = 63 - __builtin_clzll(value);
+    if (msb >= HIST_MAX_BITS)
+        return HIST_NBUCKETS - 1;
+    return (msb - HIST_SUB_BITS + 1) * HIST_SUB +
+        (value >> (msb - HIST_SUB_BITS)) - HIST_SUB;
+}
 
-        /* From here, we can call get_sysattr_value() for each file
-         * in the device's /sys entry. The strings passed into these
-         * functions (idProduct, idVendor, serial, etc.) correspond
-         * directly to the files in the directory which represents
-         * the USB device. Note that USB strings are Unicode, UCS2
-         * encoded, but the strings returned from
-         * udev_device_get_sysattr_value() are UTF-8 encoded.
-         */
-        const char *vendor  = udev_device_get_sysattr_value(usb, "manufacturer");
-        const char *product = udev_device_get_sysattr_value(usb, "product");
+/*
+ * Get the highest value, which falls into the bucket.
+ */
+unsigned long long hist_bucket_limit(unsigned index)
+{
+    unsigned shift;
 
-        char buf[1024];
-        sprintf(buf, "%s - %s %s, size %u MB",
-            devpath, vendor, product, size/2000);
-        udev_device_unref(usb);
-        devtab[ndev++] = strdup(buf);
+    if (index < HIST_SUB)
+        return index;
+    shift = index / HIST_SUB - 1;
+    return ((unsigned long long) (index % HIST_SUB + HIST_SUB + 1) << shift) - 1;
+}
+
+/*
+ * Add a sample to the histogram.
+ */
+void hist_add(struct histogram *h, unsigned long long value)
+{
+    h->bucket[hist_index(value)]++;
+    h->count++;
+    h->total += value;
+    if (value > h->max)
+        h->max = value;
+}
+
+/*
+ * Get a percentile of the histogram, for example 0.99 for p99.
+ */
+unsigned long long hist_percentile(const struct histogram *h, double fraction)
+{
+    unsigned long long limit = h->count * fraction + 0.5, sum = 0;
+    unsigned i;
+
+    if (limit < 1)
+        limit = 1;
+    for (i=0; i<HIST_NBUCKETS; i++) {
+        sum += h->bucket[i];
+        if (sum >= limit) {
+            unsigned long long value = hist_bucket_limit(i);
+            return (value < h->max) ? value : h->max;
+        }
     }
+    return h->max;
+}
 
-    /* Free the enumerator object */
-    udev_enumerate_unref(enumerate);
-    udev_unref(udev);
+/*
+ * Format a time interval in human readable form.
+ */
+char *format_ns(char *buf, unsigned long long ns)
+{
+    if (ns < 1000)
+        sprintf(buf, "%llu ns", ns);
+    else if (ns < 1000000)
+        sprintf(buf, "%.1f us", ns / 1e3);
+    else if (ns < 1000000000)
+        sprintf(buf, "%.1f ms", ns / 1e6);
+    else
+        sprintf(buf, "%.1f s", ns / 1e9);
+    return buf;
+}
 
-#elif defined(__APPLE__)
-    /*
-     * Create a list of the devices in the 'IOMedia' class.
-     */
-    CFMutableDictionaryRef dict = IOServiceMatching(kIOMediaClass);
-    if (! dict) {
-        printf("Cannot create IO Service dictionary.\n");
+/*
+ * Print time spent in every stage of the job, to find a bottleneck.
+ * Time, which is not accounted for in any stage, is shown as "other".
+ */
+void print_breakdown(unsigned long long elapsed)
+{
+    static const struct {
+        const char *name;
+        const struct histogram *hist;
+    } stage[] = {
+        { "source read",  &hist_source },
+        { "device write", &hist_write },
+        { "flush wait",   &hist_flush },
+        { "readback",     &hist_read },
+        { "compare",      &hist_compare },
+    };
+    unsigned long long other = elapsed;
+    int i;
+
+    if (elapsed == 0)
         return;
+    printf("\n      Stage:       time    share\n");
+    for (i=0; i<sizeof(stage)/sizeof(stage[0]); i++) {
+        unsigned long long t = stage[i].hist->total;
+
+        if (stage[i].hist->count == 0)
+            continue;
+        printf("%12s %8.3f s %7.1f%%\n", stage[i].name, t / 1e9, t * 100.0 / elapsed);
+        other -= (t < other) ? t : other;
     }
+    printf("%12s %8.3f s %7.1f%%\n", "other", other / 1e9, other * 100.0 / elapsed);
+    printf("%12s %8.3f s\n", "total", elapsed / 1e9);
+#ifndef MINGW32
+    struct rusage ru;
 
-    /*
-     * Select devices with attributes Removeable=True and Whole=True.
-     */
-    CFDictionarySetValue(dict, CFSTR(kIOMediaRemovableKey), kCFBooleanTrue);
-    CFDictionarySetValue(dict, CFSTR(kIOMediaWholeKey), kCFBooleanTrue);
+    /* CPU time of the whole process, all threads. */
+    if (getrusage(RUSAGE_SELF, &ru) == 0) {
+        double user = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6;
+        double sys = ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
 
-    io_iterator_t devices = IO_OBJECT_NULL;
-    kern_return_t result = IOServiceGetMatchingServices(kIOMasterPortDefault,
-        dict, &devices);
-    if (result != KERN_SUCCESS) {
-        printf("Cannot find matching IO services.\n");
-        return;
+        printf("%12s %8.3f s %7.1f%%\n", "cpu user", user, user * 1e11 / elapsed);
+        printf("%12s %8.3f s %7.1f%%\n", "cpu system", sys, sys * 1e11 / elapsed);
     }
+#endif
+}
 
-    /*
-     * For each matching device, print out its information.
-     */
-    io_object_t device;
-    while ((device = IOIteratorNext(devices)) != MACH_PORT_NULL) {
-        /*
-         * Get device path.
-         */
-        char devname[1024] = "/dev/r";
-        CFStringRef ref = (CFStringRef) IORegistryEntrySearchCFProperty(device,
-            kIOServicePlane, CFSTR(kIOBSDNameKey),
-            kCFAllocatorDefault, kIORegistryIterateRecursively);
-        if (! ref || ! CFStringGetCString(ref, devname + 6,
-            sizeof(devname) - 6, kCFStringEncodingUTF8)) {
-            /* Cannot get device path. */
-            continue;
-        }
+/*
+ * Progress of the current job, shared with the monitor thread.
+ * Updated by the I/O loop with atomic stores.
+ */
+const char *job_phase;          /* Current phase: "write" or "verify" */
+unsigned long long job_bytes;   /* Bytes completed in current phase */
+unsigned long long job_total;   /* Total bytes in current phase */
 
-        /*
-         * Get device size in bytes.
-         */
-        long long size;
-        ref = IORegistryEntryCreateCFProperty(device,
-            CFSTR(kIOMediaSizeKey), kCFAllocatorDefault, 0);
-        if (! ref || ! CFNumberGetValue((CFNumberRef)ref, kCFNumberLongLongType, &size)) {
-            /* Cannot get device size. */
-            continue;
-        }
+/*
+ * Request in flight, watched by the monitor thread.
+ */
+const char *io_name;            /* Type of request: "write", "read" or "flush" */
+unsigned long long io_started;  /* Start time of the request, or 0 when idle */
+unsigned long long io_offset;   /* Device offset of the request */
+unsigned long long io_reported; /* Start time of the request, reported as stalled */
 
-        /*
-         * Get a list of device characteristics.
-         */
-        CFMutableDictionaryRef dict = (CFMutableDictionaryRef)
-            IORegistryEntrySearchCFProperty(device, kIOServicePlane,
-            CFSTR(kIOPropertyDeviceCharacteristicsKey),
-            kCFAllocatorDefault, kIORegistryIterateParents | kIORegistryIterateRecursively);
-        if (! dict) {
-            /* Cannot get device characteristics. */
-            continue;
-        }
+/*
+ * Stalls of the device: requests slower than stall_msec,
+ * and drops of throughput well below the average.
+ */
+#define CLIFF_FRACTION  0.25            /* Rate drop relative to average */
+#define CLIFF_WARMUP    2000000000ULL   /* Ignore the first 2 seconds */
 
-        /*
-         * Get vendor and product names.
-         */
-        char vendor[1024], product[1024];
-        ref = CFDictionaryGetValue(dict, CFSTR(kIOPropertyVendorNameKey));
-        if (! ref || ! CFStringGetCString(ref, vendor,
-            sizeof(vendor), kCFStringEncodingUTF8)) {
-            /* Cannot get vendor name. */
-            continue;
-        }
-        ref = CFDictionaryGetValue(dict, CFSTR(kIOPropertyProductNameKey));
-        if (! ref || ! CFStringGetCString(ref, product,
-            sizeof(product), kCFStringEncodingUTF8)) {
-            /* Cannot get product name. */
-            continue;
-        }
+unsigned stall_count;           /* Number of slow requests */
+unsigned long long stall_max;   /* Longest stall, ns */
+unsigned cliff_count;           /* Number of throughput drops */
+unsigned stall_free;            /* Requests since the last stall */
+unsigned io_size;               /* Current request size, reduced on stalls */
 
-        char buf[1024];
-        sprintf(buf, "%s - size %u MB, %s %s",
-            devname, (unsigned) (size / 1000000), vendor, product);
-        IOObjectRelease(device);
-        devtab[ndev++] = strdup(buf);
-    }
+#define ADAPT_MIN_SIZE  4096            /* Least request size with --adapt */
+unsigned retry_count;           /* Number of retried requests */
+unsigned reopen_count;          /* Number of times the device was reopened */
 
-    /* Free the iterator object */
-    IOObjectRelease(devices);
-#elif defined(MINGW32)
-    /*
-     * Create a list of the removable USB disk devices.
-     */
+/*
+ * Monitor thread: samples the progress at a fixed interval,
+ * without any cost for the I/O loop.
+ */
+#define SAMPLE_MSEC     250             /* Sampling interval */
+#define SMOOTH_FACTOR   0.25            /* Weight of new sample in smoothed rate */
 
-    /* Get a bitmask of available drives (bit 0 = A:, bit 1 = B:, etc). */
-    unsigned drive_mask = GetLogicalDrives();
-    int i;
+pthread_t monitor_thread;
+pthread_mutex_t monitor_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t monitor_wakeup = PTHREAD_COND_INITIALIZER;
+int monitor_running;
+unsigned long long monitor_t0;  /* Start time, ns */
+unsigned long long phase_t0;    /* Start time of current phase, ns */
+FILE *series_file;              /* Throughput time series */
+int series_json;                /* Time series in JSON format */
+int series_count;               /* Number of samples written */
+FILE *progress_file;            /* Progress stream, opened on progress_fd */
 
-    for (i = 0; drive_mask != 0; i++, drive_mask >>= 1) {
-        if (! (drive_mask & 1))
-            continue;
+/*
+ * Progress bar is drawn by the monitor thread.
+ * The lock serializes drawing with the start and end of a phase.
+ */
+#define BAR_WIDTH       40
 
-        char drive_char = 'A' + i;
-        char drive_name[] = "\\\\.\\A:\\";
-        drive_name[4] = drive_char;
+pthread_mutex_t render_lock = PTHREAD_MUTEX_INITIALIZER;
+int render_active;              /* Progress bar is shown */
 
-        int drive_type = GetDriveType(drive_name);
-        if (drive_type != DRIVE_REMOVABLE)
-            continue;
+/*
+ * Print a symbol repeated.
+ */
+void print_symbols(char symbol, int cnt)
+{
+    while (cnt-- > 0)
+        putchar(symbol);
+}
 
-        drive_name[6] = 0;
-        HANDLE h = CreateFile(drive_name, FILE_READ_ATTRIBUTES,
-            FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
-            OPEN_EXISTING, 0, NULL);
-        if (h == INVALID_HANDLE_VALUE)
-            continue;
+/*
+ * Draw the progress bar, with rate and time left.
+ * Must be called with render_lock held.
+ */
+void render_progress(const char *phase, unsigned long long bytes,
+    unsigned long long total, double rate)
+{
+    int filled = total ? bytes * BAR_WIDTH / total : BAR_WIDTH;
+    int percent = total ? bytes * 100 / total : 100;
+    char label[16];
 
-        /* Ensure that the drive is actually accessible.
-         * Multi-card hubs were reporting "removable" even when empty. */
-        DWORD dwOutBytes;
-        if (! DeviceIoControl(h, IOCTL_STORAGE_CHECK_VERIFY2,
-                NULL, 0, NULL, 0, &dwOutBytes, NULL))
-        {
-            /* IOCTL_STORAGE_CHECK_VERIFY2 fails on some devices under XP/Vista.
-             * Try the other (slower) method, just in case. */
-            HANDLE g = CreateFile(drive_name, FILE_READ_DATA,
-                FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
-                OPEN_EXISTING, 0, NULL);
-            if (g == INVALID_HANDLE_VALUE) {
-                CloseHandle(h);
-                continue;
-            }
-            if (! DeviceIoControl(g, IOCTL_STORAGE_CHECK_VERIFY,
-                    NULL, 0, NULL, 0, &dwOutBytes, NULL)) {
-                CloseHandle(g);
-                CloseHandle(h);
-                continue;
-            }
-            CloseHandle(g);
+    /* Label is capitalized phase name, like "Write". */
+    snprintf(label, sizeof(label), "%s", phase);
+    label[0] &= ~040;
+
+    printf("\r%11s: ", label);
+    print_symbols('#', filled);
+    print_symbols('.', BAR_WIDTH - filled);
+    printf(" %3d%%", percent);
+    if (rate > 0) {
+        printf(" %6.1f MB/sec", rate);
+        if (total > bytes) {
+            unsigned left = (total - bytes) / 1e6 / rate + 0.5;
+            printf(", %u:%02u left ", left / 60, left % 60);
         }
+    }
+    fflush(stdout);
+}
 
-        char sdbuf[sizeof(STORAGE_DEVICE_DESCRIPTOR) + 512 - 1];
-        PSTORAGE_DEVICE_DESCRIPTOR sd = (void*) sdbuf;
-        sd->Size = sizeof(sdbuf);
+/*
+ * Set the current phase of the job, and show the progress bar.
+ */
+void job_start_phase(const char *phase, unsigned long long total)
+{
+    __atomic_store_n(&job_total, total, __ATOMIC_RELAXED);
+    __atomic_store_n(&job_bytes, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&phase_t0, timestamp_ns(), __ATOMIC_RELAXED);
+    __atomic_store_n(&job_phase, phase, __ATOMIC_RELEASE);
 
-        STORAGE_PROPERTY_QUERY query;
-        query.PropertyId = StorageDeviceProperty;
-        query.QueryType = PropertyStandardQuery;
-        if (! DeviceIoControl(h, IOCTL_STORAGE_QUERY_PROPERTY,
-                            &query, sizeof(STORAGE_PROPERTY_QUERY), sd,
-                            sd->Size, &dwOutBytes, NULL)) {
-            CloseHandle(h);
+    pthread_mutex_lock(&render_lock);
+    render_active = 1;
+    render_progress(phase, 0, total, 0);
+    pthread_mutex_unlock(&render_lock);
+}
+
+/*
+ * Finish the current phase: show the complete progress bar
+ * with the average rate.
+ */
+void job_end_phase()
+{
+    const char *phase = __atomic_load_n(&job_phase, __ATOMIC_ACQUIRE);
+    unsigned long long bytes = __atomic_load_n(&job_bytes, __ATOMIC_RELAXED);
+    unsigned long long elapsed = timestamp_ns() - phase_t0;
+
+    pthread_mutex_lock(&render_lock);
+    render_progress(phase, bytes, bytes, elapsed ? bytes * 1e3 / elapsed : 0);
+    printf(" done        \n");
+    render_active = 0;
+    pthread_mutex_unlock(&render_lock);
+}
+
+/*
+ * Advance progress of the current phase.
+ */
+void job_advance(unsigned long long nbytes)
+{
+    __atomic_fetch_add(&job_bytes, nbytes, __ATOMIC_RELAXED);
+}
+
+/*
+ * Move the progress of the job back, when data are written again.
+ */
+void job_rewind(unsigned long long nbytes)
+{
+    __atomic_fetch_sub(&job_bytes, nbytes, __ATOMIC_RELAXED);
+}
+
+/*
+ * Write one sample of the throughput time series.
+ */
+void series_sample(unsigned long long now, const char *phase,
+    unsigned long long offset, double rate, double smooth)
+{
+    double t = (now - monitor_t0) / 1e9;
+
+    if (series_json) {
+        fprintf(series_file, "%s\n  {\"time\": %.3f, \"phase\": \"%s\", "
+            "\"offset\": %llu, \"rate\": %.2f, \"smoothed\": %.2f}",
+            series_count ? "," : "", t, phase, offset, rate, smooth);
+    } else {
+        fprintf(series_file, "%.3f,%s,%llu,%.2f,%.2f\n",
+            t, phase, offset, rate, smooth);
+    }
+    series_count++;
+}
+
+/*
+ * Report progress as a JSON line, for GUI or rack controller.
+ * ETA is estimated from the smoothed rate.
+ */
+void progress_report(const char *phase, unsigned long long bytes,
+    double rate, double smooth)
+{
+    unsigned long long total = __atomic_load_n(&job_total, __ATOMIC_RELAXED);
+    double eta = (smooth > 0 && total > bytes) ? (total - bytes) / 1e6 / smooth : 0;
+
+    fprintf(progress_file, "{\"phase\": \"%s\", \"bytes\": %llu, \"total\": %llu, "
+        "\"rate\": %.2f, \"eta\": %.1f}\n", phase, bytes, total, rate, eta);
+    fflush(progress_file);
+}
+
+/*
+ * Start timing of a request at the device offset.
+ */
+unsigned long long io_begin(const char *name, unsigned long long offset)
+{
+    unsigned long long t0 = timestamp_ns();
+
+    __atomic_store_n(&io_name, name, __ATOMIC_RELAXED);
+    __atomic_store_n(&io_offset, offset, __ATOMIC_RELAXED);
+    __atomic_store_n(&io_started, t0, __ATOMIC_RELEASE);
+    return t0;
+}
+
+/*
+ * Finish timing of a request: record the latency, and check for a stall.
+ * With --adapt, halve the request size on every stall, down to 4 kbytes,
+ * and double it back after 100 fast requests.
+ * Return the latency in nanoseconds.
+ */
+unsigned long long io_end(struct histogram *h, unsigned long long t0)
+{
+    unsigned long long latency = timestamp_ns() - t0;
+
+    __atomic_store_n(&io_started, 0, __ATOMIC_RELEASE);
+    hist_add(h, latency);
+
+    if (latency < stall_msec * 1000000ULL) {
+        if (adaptive && ++stall_free >= 100 && io_size < block_size) {
+            io_size *= 2;
+            stall_free = 0;
+        }
+        return latency;
+    }
+    char took[32];
+
+    stall_count++;
+    stall_free = 0;
+    if (latency > stall_max)
+        stall_max = latency;
+    /* Report the stall, unless the watchdog did it already. */
+    if (__atomic_load_n(&io_reported, __ATOMIC_ACQUIRE) != t0)
+        fprintf(stderr, "\nStall: %s at offset %llu took %s\n", h->name,
+            __atomic_load_n(&io_offset, __ATOMIC_RELAXED), format_ns(took, latency));
+
+    if (adaptive && io_size > ADAPT_MIN_SIZE) {
+        io_size /= 2;
+        fprintf(stderr, "Reduce request size to %u kbytes\n", io_size / 1024);
+    }
+    return latency;
+}
+
+/*
+ * Check for a request which is stuck in the device,
+ * and for the throughput falling much below the average.
+ */
+void watchdog(unsigned long long now, double smooth, unsigned long long bytes)
+{
+    static int cliff;
+    unsigned long long started = __atomic_load_n(&io_started, __ATOMIC_ACQUIRE);
+
+    /* Report every stuck request once, while it still blocks. */
+    if (started && started != __atomic_load_n(&io_reported, __ATOMIC_RELAXED) &&
+        now - started >= stall_msec * 1000000ULL) {
+        __atomic_store_n(&io_reported, started, __ATOMIC_RELEASE);
+        fprintf(stderr, "\nStall: %s at offset %llu blocked for %.1f sec\n",
+            __atomic_load_n(&io_name, __ATOMIC_RELAXED),
+            __atomic_load_n(&io_offset, __ATOMIC_RELAXED), (now - started) / 1e9);
+    }
+
+    /* Compare the smoothed rate with the average of the phase. */
+    if (now - phase_t0 > CLIFF_WARMUP) {
+        double average = bytes * 1e3 / (now - phase_t0);
+
+        if (! cliff && smooth < average * CLIFF_FRACTION) {
+            cliff = 1;
+            cliff_count++;
+            fprintf(stderr, "\nSlowdown: %.1f MB/sec at offset %llu, average %.1f MB/sec\n",
+                smooth, bytes, average);
+        } else if (cliff && smooth > average * 2 * CLIFF_FRACTION) {
+            cliff = 0;
+        }
+    }
+}
+
+/*
+ * Metrics for Prometheus node_exporter textfile collector.
+ * Counters are accumulated across runs: previous values
+ * are read from the metrics file at start.
+ */
+#define METRICS_MSEC    5000            /* Update interval */
+
+int job_started;                /* The job has started: metrics are valid */
+double current_rate;            /* Smoothed rate of current phase, MB/sec */
+unsigned long long bytes_written; /* Bytes written to the device in this run */
+
+struct metrics_counters {
+    double cards_written;       /* Cards written successfully */
+    double cards_verified;      /* Cards verified successfully */
+    double cards_failed;        /* Jobs failed */
+    double bytes_written;       /* Bytes written to all cards */
+    double stalls;              /* Device stalls */
+    double retries;             /* Retried requests */
+};
+
+struct metrics_counters metrics_sent; /* Counts of this run, already in the file */
+char **metrics_other;           /* Samples of other devices, from the file */
+unsigned metrics_nother;        /* Number of such samples */
+
+/*
+ * Check whether the sample has a device label, other than ours.
+ */
+int metrics_other_device(const char *line)
+{
+    const char *label = strstr(line, "{device=\"");
+    int len = strlen(device_name);
+
+    if (! label)
+        return 0;
+    label += 9;
+    return strncmp(label, device_name, len) != 0 || label[len] != '"';
+}
+
+/*
+ * Read the metrics file, as left by this or another instance
+ * of sdwriter: current values of counters, and samples of other
+ * devices, which must be kept.
+ */
+void metrics_load(struct metrics_counters *total)
+{
+    char line[512], name[128];
+    double value;
+    FILE *fd;
+
+    memset(total, 0, sizeof(*total));
+    while (metrics_nother > 0)
+        free(metrics_other[--metrics_nother]);
+    fd = fopen(metrics_filename, "r");
+    if (! fd)
+        return;
+    while (fgets(line, sizeof(line), fd)) {
+        if (line[0] != '#' && metrics_other_device(line)) {
+            char **other = realloc(metrics_other, (metrics_nother + 1) * sizeof(char*));
+
+            if (other) {
+                metrics_other = other;
+                metrics_other[metrics_nother] = strdup(line);
+                if (metrics_other[metrics_nother])
+                    metrics_nother++;
+            }
             continue;
         }
-        if (sd->BusType != BusTypeUsb) {
-            CloseHandle(h);
+        if (sscanf(line, "%127s %lf", name, &value) != 2)
             continue;
+        if (strcmp(name, "sdwriter_cards_written_total") == 0)
+            total->cards_written = value;
+        else if (strcmp(name, "sdwriter_cards_verified_total") == 0)
+            total->cards_verified = value;
+        else if (strcmp(name, "sdwriter_cards_failed_total") == 0)
+            total->cards_failed = value;
+        else if (strcmp(name, "sdwriter_bytes_written_total") == 0)
+            total->bytes_written = value;
+        else if (strcmp(name, "sdwriter_stalls_total") == 0)
+            total->stalls = value;
+        else if (strcmp(name, "sdwriter_retries_total") == 0)
+            total->retries = value;
+    }
+    fclose(fd);
+}
+
+/*
+ * Print samples of other devices for the metric family.
+ */
+void metrics_print_other(FILE *fd, const char *family)
+{
+    unsigned i, len = strlen(family);
+
+    for (i=0; i<metrics_nother; i++) {
+        if (strncmp(metrics_other[i], family, len) == 0)
+            fputs(metrics_other[i], fd);
+    }
+}
+
+/*
+ * Print one metric with HELP and TYPE lines.
+ */
+void metric_print(FILE *fd, const char *name, const char *type,
+    const char *help, double value)
+{
+    fprintf(fd, "# HELP %s %s\n", name, help);
+    fprintf(fd, "# TYPE %s %s\n", name, type);
+    fprintf(fd, "%s %.17g\n", name, value);
+}
+
+/*
+ * Print the latency histogram in Prometheus format,
+ * with buckets from 100 usec to 10 sec.
+ */
+void metric_histogram(FILE *fd, const struct histogram *h)
+{
+    static const double le[] = { 0.0001, 0.001, 0.01, 0.1, 1, 10 };
+    unsigned long long count = 0;
+    unsigned i, k = 0;
+
+    for (i=0; i<sizeof(le)/sizeof(le[0]); i++) {
+        /* Sum all buckets which fit below the limit. */
+        for (; k<HIST_NBUCKETS && hist_bucket_limit(k) < le[i] * 1e9; k++)
+            count += h->bucket[k];
+        fprintf(fd, "sdwriter_request_latency_seconds_bucket{device=\"%s\",op=\"%s\",le=\"%g\"} %llu\n",
+            device_name, h->name, le[i], count);
+    }
+    fprintf(fd, "sdwriter_request_latency_seconds_bucket{device=\"%s\",op=\"%s\",le=\"+Inf\"} %llu\n",
+        device_name, h->name, h->count);
+    fprintf(fd, "sdwriter_request_latency_seconds_sum{device=\"%s\",op=\"%s\"} %.9f\n",
+        device_name, h->name, h->total / 1e9);
+    fprintf(fd, "sdwriter_request_latency_seconds_count{device=\"%s\",op=\"%s\"} %llu\n",
+        device_name, h->name, h->count);
+}
+
+/*
+ * Write the metrics file: first into a temporary file,
+ * then rename it, so the collector never sees a partial file.
+ * Several instances of sdwriter may share the file: under a lock,
+ * the file is read again, counts of this run are added to the totals,
+ * and samples of other devices are kept.
+ * Histograms are read while the I/O loop updates them:
+ * the values may be slightly inconsistent, which is fine for monitoring.
+ */
+void metrics_write(int busy, double written, double verified, double failed)
+{
+    char tmpname[PATH_MAX + 32], lockname[PATH_MAX + 8];
+    const char *phase = __atomic_load_n(&job_phase, __ATOMIC_ACQUIRE);
+    struct metrics_counters total, now;
+    int lock = -1;
+    FILE *fd;
+
+    now.cards_written = written;
+    now.cards_verified = verified;
+    now.cards_failed = failed;
+    now.bytes_written = __atomic_load_n(&bytes_written, __ATOMIC_RELAXED);
+    now.stalls = stall_count;
+    now.retries = retry_count;
+
+#ifndef MINGW32
+    snprintf(lockname, sizeof(lockname), "%s.lock", metrics_filename);
+    lock = open(lockname, O_RDWR | O_CREAT, 0644);
+    if (lock >= 0)
+        flock(lock, LOCK_EX);
+#endif
+    metrics_load(&total);
+    total.cards_written += now.cards_written - metrics_sent.cards_written;
+    total.cards_verified += now.cards_verified - metrics_sent.cards_verified;
+    total.cards_failed += now.cards_failed - metrics_sent.cards_failed;
+    total.bytes_written += now.bytes_written - metrics_sent.bytes_written;
+    total.stalls += now.stalls - metrics_sent.stalls;
+    total.retries += now.retries - metrics_sent.retries;
+
+    snprintf(tmpname, sizeof(tmpname), "%s.%d.tmp", metrics_filename, (int) getpid());
+    fd = fopen(tmpname, "w");
+    if (! fd) {
+        perror(tmpname);
+        goto done;
+    }
+    metric_print(fd, "sdwriter_cards_written_total", "counter",
+        "Cards written successfully.", total.cards_written);
+    metric_print(fd, "sdwriter_cards_verified_total", "counter",
+        "Cards verified successfully.", total.cards_verified);
+    metric_print(fd, "sdwriter_cards_failed_total", "counter",
+        "Failed jobs.", total.cards_failed);
+    metric_print(fd, "sdwriter_bytes_written_total", "counter",
+        "Bytes written to cards.", total.bytes_written);
+    metric_print(fd, "sdwriter_stalls_total", "counter",
+        "Device requests slower than the stall threshold.", total.stalls);
+    metric_print(fd, "sdwriter_retries_total", "counter",
+        "Device requests retried after an error.", total.retries);
+    metric_print(fd, "sdwriter_last_update_timestamp_seconds", "gauge",
+        "Time of the last update.", (double) time(0));
+
+    fprintf(fd, "# HELP sdwriter_busy A job is in progress on the device.\n");
+    fprintf(fd, "# TYPE sdwriter_busy gauge\n");
+    fprintf(fd, "sdwriter_busy{device=\"%s\"} %d\n", device_name, busy);
+    metrics_print_other(fd, "sdwriter_busy{");
+
+    fprintf(fd, "# HELP sdwriter_throughput_mbytes_per_second Current data rate of the device.\n");
+    fprintf(fd, "# TYPE sdwriter_throughput_mbytes_per_second gauge\n");
+    fprintf(fd, "sdwriter_throughput_mbytes_per_second{device=\"%s\",phase=\"%s\"} %.2f\n",
+        device_name, phase ? phase : "idle", busy ? current_rate : 0);
+    metrics_print_other(fd, "sdwriter_throughput_mbytes_per_second{");
+
+    fprintf(fd, "# HELP sdwriter_request_latency_seconds Latency of device requests in the last job.\n");
+    fprintf(fd, "# TYPE sdwriter_request_latency_seconds histogram\n");
+    metric_histogram(fd, &hist_write);
+    metric_histogram(fd, &hist_flush);
+    metric_histogram(fd, &hist_read);
+    metrics_print_other(fd, "sdwriter_request_latency_seconds_");
+
+    if (fclose(fd) != 0 || rename(tmpname, metrics_filename) != 0) {
+        perror(metrics_filename);
+        unlink(tmpname);
+        goto done;
+    }
+    metrics_sent = now;
+done:
+    if (lock >= 0)
+        close(lock);
+}
+
+/*
+ * Update the metrics at the end of the job.
+ */
+void metrics_finish(int ok)
+{
+    if (! metrics_filename || ! job_started)
+        return;
+    job_started = 0;
+    metrics_write(0, ok && ! verify_only, ok && verify_only, ! ok);
+}
+
+/*
+ * Body of the monitor thread.
+ */
+void *monitor_loop(void *arg)
+{
+    const char *last_phase = 0;
+    unsigned long long last_bytes = 0, last_time = monitor_t0;
+    unsigned long long last_metrics = monitor_t0;
+    unsigned long long next = monitor_t0;
+    double smooth = 0;
+    int running = 1;
+
+    pthread_mutex_lock(&monitor_lock);
+    while (running) {
+        /* Sleep until the next tick, or until stopped. */
+        struct timeval tv;
+        struct timespec deadline;
+        unsigned long long now = timestamp_ns();
+
+        next += SAMPLE_MSEC * 1000000ULL;
+        if (next > now) {
+            unsigned long long delay = next - now;
+
+            gettimeofday(&tv, 0);
+            delay += tv.tv_usec * 1000ULL;
+            deadline.tv_sec = tv.tv_sec + delay / 1000000000;
+            deadline.tv_nsec = delay % 1000000000;
+            if (monitor_running)
+                pthread_cond_timedwait(&monitor_wakeup, &monitor_lock, &deadline);
         }
+        running = monitor_running;
+        pthread_mutex_unlock(&monitor_lock);
 
-        /* Get the device number. */
-        typedef struct _DEVICE_NUMBER {
-            DEVICE_TYPE  DeviceType;
-            ULONG  DeviceNumber;
-            ULONG  PartitionNumber;
-        } DEVICE_NUMBER;
-        DEVICE_NUMBER dev_num;
-        if (! DeviceIoControl(h, IOCTL_STORAGE_GET_DEVICE_NUMBER,
-                              NULL, 0, &dev_num, sizeof(DEVICE_NUMBER),
-                              &dwOutBytes, NULL)) {
-            CloseHandle(h);
-            continue;
+        /* Take a sample. */
+        const char *phase = __atomic_load_n(&job_phase, __ATOMIC_ACQUIRE);
+        unsigned long long bytes = __atomic_load_n(&job_bytes, __ATOMIC_RELAXED);
+        now = timestamp_ns();
+        if (phase != last_phase) {
+            /* New phase: start from zero. */
+            last_phase = phase;
+            last_bytes = 0;
+            smooth = 0;
         }
+        if (phase && now > last_time) {
+            double rate = (bytes - last_bytes) * 1e3 / (now - last_time);
 
-        DISK_GEOMETRY_EX geom;
-        if (! DeviceIoControl(h, IOCTL_DISK_GET_DRIVE_GEOMETRY_EX, NULL, 0,
-                &geom, sizeof(geom), &dwOutBytes, NULL)) {
-            CloseHandle(h);
-            continue;
+            smooth = smooth ? smooth + SMOOTH_FACTOR * (rate - smooth) : rate;
+            current_rate = smooth;
+            if (series_file)
+                series_sample(now, phase, bytes, rate, smooth);
+            if (progress_file)
+                progress_report(phase, bytes, rate, smooth);
+            watchdog(now, smooth, bytes);
+
+            pthread_mutex_lock(&render_lock);
+            if (render_active)
+                render_progress(phase, bytes,
+                    __atomic_load_n(&job_total, __ATOMIC_RELAXED), smooth);
+            pthread_mutex_unlock(&render_lock);
         }
-        unsigned mbytes = geom.DiskSize.QuadPart / 1000000;
-        CloseHandle(h);
+        if (metrics_filename && running &&
+            now - last_metrics >= METRICS_MSEC * 1000000ULL) {
+            metrics_write(1, 0, 0, 0);
+            last_metrics = now;
+        }
+        last_bytes = bytes;
+        last_time = now;
+        pthread_mutex_lock(&monitor_lock);
+    }
+    pthread_mutex_unlock(&monitor_lock);
+    return 0;
+}
+
+/*
+ * Start the monitor thread, when needed.
+ */
+void monitor_start()
+{
+    if (series_filename) {
+        const char *ext = strrchr(series_filename, '.');
 
-        char buf[1024];
-        sprintf(buf, "\\\\.\\PhysicalDrive%u - Disk %c: size %u MB",
-            (unsigned) dev_num.DeviceNumber, drive_char, mbytes);
-        devtab[ndev++] = strdup(buf);
+        series_file = fopen(series_filename, "w");
+        if (! series_file) {
+            perror(series_filename);
+            quit(0);
+        }
+        series_json = (ext && strcmp(ext, ".json") == 0);
+        if (series_json)
+            fprintf(series_file, "[");
+        else
+            fprintf(series_file, "time,phase,offset,rate,smoothed\n");
+    }
+    if (progress_fd >= 0 && ! progress_file) {
+        progress_file = fdopen(progress_fd, "w");
+        if (! progress_file) {
+            fprintf(stderr, "Bad progress descriptor %d: %s\n",
+                progress_fd, strerror(errno));
+            quit(0);
+        }
+    }
+
+    if (metrics_filename) {
+        job_started = 1;
+        metrics_write(1, 0, 0, 0);
     }
-#else
-    printf("Don't know how to get the list of CD devices on this system.\n");
-#endif
 
-    devtab[ndev] = 0;
+    monitor_t0 = timestamp_ns();
+    monitor_running = 1;
+    if (thread_create(&monitor_thread, monitor_loop, 0) != 0) {
+        fprintf(stderr, "Cannot create monitor thread\n");
+        monitor_running = 0;
+    }
 }
 
-#ifdef MINGW32
 /*
- * Lock a filesystem while writing to the disk.
- * Windows-specific action.
+ * Stop the monitor thread and close the output files.
  */
-void lock_volume(int volume_id)
+void monitor_stop()
 {
-    char name[] = "\\\\.\\A:";
-    name[4] += volume_id;
+    if (monitor_running) {
+        pthread_mutex_lock(&monitor_lock);
+        monitor_running = 0;
+        pthread_cond_signal(&monitor_wakeup);
+        pthread_mutex_unlock(&monitor_lock);
+        pthread_join(monitor_thread, 0);
+    }
+    if (series_file) {
+        if (series_json)
+            fprintf(series_file, "%s]\n", series_count ? "\n" : "");
+        fclose(series_file);
+        series_file = 0;
+    }
+}
 
-    /* Open volume. */
-    HANDLE h = CreateFile(name, GENERIC_WRITE,
-        FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
-    if (h == INVALID_HANDLE_VALUE) {
-        printf("Failed to open volume %s\n", name);
+/*
+ * Print percentiles of the latency histogram.
+ */
+void print_latency(const struct histogram *h)
+{
+    char p50[32], p90[32], p99[32], max[32];
+
+    if (h->count == 0)
         return;
+    printf("%11s %10llu %10s %10s %10s %10s\n", h->name, h->count,
+        format_ns(p50, hist_percentile(h, 0.50)),
+        format_ns(p90, hist_percentile(h, 0.90)),
+        format_ns(p99, hist_percentile(h, 0.99)),
+        format_ns(max, h->max));
+}
+
+#ifdef __linux__
+/*
+ * Get bus timing of the MMC host controller, like "sd uhs SDR104, 208 MHz".
+ * This information is available only via debugfs, and needs root access.
+ * Return 0 when unknown.
+ */
+int mmc_bus_timing(const char *host, char *timing, int maxlen)
+{
+    char path[256], line[256], spec[128];
+    unsigned long clock = 0;
+    FILE *fd;
+
+    sprintf(path, "/sys/kernel/debug/%.64s/ios", host);
+    fd = fopen(path, "r");
+    if (! fd)
+        return 0;
+
+    spec[0] = 0;
+    while (fgets(line, sizeof(line), fd)) {
+        if (strncmp(line, "clock:", 6) == 0) {
+            clock = strtoul(line + 6, 0, 10);
+        } else if (strncmp(line, "timing spec:", 12) == 0) {
+            /* Text inside parentheses: "timing spec: 6 (sd uhs SDR104)" */
+            char *p = strchr(line, '(');
+            char *q = strrchr(line, ')');
+            if (p && q && q > p) {
+                *q = 0;
+                snprintf(spec, sizeof(spec), "%s", p + 1);
+            }
+        }
     }
+    fclose(fd);
+
+    if (! spec[0])
+        return 0;
+    if (clock > 0)
+        snprintf(timing, maxlen, "%s, %lu MHz", spec, clock / 1000000);
+    else
+        snprintf(timing, maxlen, "%s", spec);
+    return 1;
+}
+
+/*
+ * Find a whole disk, which holds the root filesystem.
+ * Return a syspath, or 0 when unknown.
+ */
+char *get_root_disk(struct udev *udev)
+{
+    struct stat st;
+    struct udev_device *dev, *disk;
+    char *syspath;
+
+    if (stat("/", &st) < 0)
+        return 0;
+    dev = udev_device_new_from_devnum(udev, 'b', st.st_dev);
+    if (! dev)
+        return 0;
+
+    disk = dev;
+    const char *devtype = udev_device_get_devtype(dev);
+    if (devtype && strcmp(devtype, "partition") == 0)
+        disk = udev_device_get_parent_with_subsystem_devtype(dev, "block", "disk");
+
+    syspath = disk ? strdup(udev_device_get_syspath(disk)) : 0;
+    udev_device_unref(dev);
+    return syspath;
+}
+
+/*
+ * Get a numeric attribute of the device, or 0 when not available.
+ */
+unsigned long long sysattr_number(struct udev_device *dev, const char *name)
+{
+    const char *value = udev_device_get_sysattr_value(dev, name);
+
+    return value ? strtoull(value, 0, 0) : 0;
+}
+
+/*
+ * Copy a string attribute of the device, stripping spaces.
+ */
+void sysattr_string(struct udev_device *dev, const char *name,
+    char *buf, int maxlen)
+{
+    const char *value = udev_device_get_sysattr_value(dev, name);
+    int len;
+
+    if (! value)
+        value = "";
+    while (*value == ' ')
+        value++;
+    snprintf(buf, maxlen, "%s", value);
+    len = strlen(buf);
+    while (len > 0 && (buf[len-1] == ' ' || buf[len-1] == '\n'))
+        buf[--len] = 0;
+}
+
+/*
+ * Find mounted filesystems on the disk or any of its partitions.
+ * When mountpoints[] is not null, store there the mount points.
+ * Return a number of mounts found.
+ */
+int get_mounts(const char *syspath, char *mountpoints[], int maxcount)
+{
+    char line[4096], path[64], real[PATH_MAX];
+    unsigned major, minor;
+    int count = 0, len = strlen(syspath);
+    FILE *fd;
+
+    fd = fopen("/proc/self/mountinfo", "r");
+    if (! fd)
+        return 0;
+
+    while (fgets(line, sizeof(line), fd) && count < maxcount) {
+        /* Line format: "36 35 98:0 /mnt1 /mnt2 rw,noatime ..." */
+        char mnt[PATH_MAX];
+        if (sscanf(line, "%*u %*u %u:%u %*s %4095s", &major, &minor, mnt) != 3)
+            continue;
+
+        /* Map the device number into a sysfs path. */
+        sprintf(path, "/sys/dev/block/%u:%u", major, minor);
+        if (! realpath(path, real))
+            continue;
+        if (strncmp(real, syspath, len) != 0 ||
+            (real[len] != 0 && real[len] != '/'))
+            continue;
+
+        if (mountpoints) {
+            /* Decode octal escapes, like \040 for space. */
+            char *p, *q;
+            for (p=q=mnt; *p; q++) {
+                if (p[0] == '\\' && p[1] >= '0' && p[1] <= '3') {
+                    *q = strtoul(p+1, 0, 8) & 0xff;
+                    p += 4;
+                } else
+                    *q = *p++;
+            }
+            *q = 0;
+            mountpoints[count] = strdup(mnt);
+        }
+        count++;
+    }
+    fclose(fd);
+    return count;
+}
+
+/*
+ * Get request queue limits and other properties of the block device.
+ */
+void get_queue_info(struct udev_device *dev, struct device_info *info)
+{
+    info->logical_block     = sysattr_number(dev, "queue/logical_block_size");
+    info->physical_block    = sysattr_number(dev, "queue/physical_block_size");
+    info->max_sectors_kb    = sysattr_number(dev, "queue/max_sectors_kb");
+    info->max_hw_sectors_kb = sysattr_number(dev, "queue/max_hw_sectors_kb");
+    info->nr_requests       = sysattr_number(dev, "queue/nr_requests");
+    info->discard_max       = sysattr_number(dev, "queue/discard_max_bytes");
+    info->rotational        = sysattr_number(dev, "queue/rotational");
+    info->mounted           = get_mounts(udev_device_get_syspath(dev), 0, 1000);
+}
+
+/*
+ * Extract a bit field [hi:lo] from a register in hex format.
+ * Bit 0 is the last bit of the string.
+ */
+unsigned reg_bits(const char *hex, int nbits, int hi, int lo)
+{
+    unsigned value = 0;
+    int bit;
+
+    if (strlen(hex) * 4 < nbits)
+        return 0;
+    for (bit=hi; bit>=lo; bit--) {
+        char c = hex[(nbits - 1 - bit) / 4];
+        unsigned digit = (c >= 'a') ? c - 'a' + 10 :
+                         (c >= 'A') ? c - 'A' + 10 : c - '0';
+        value <<= 1;
+        value |= (digit >> (bit % 4)) & 1;
+    }
+    return value;
+}
+
+/*
+ * Get speed class and allocation unit size from the SD Status register.
+ */
+void parse_ssr(const char *ssr, struct device_info *info)
+{
+    static const unsigned speed_class[] = { 0, 2, 4, 6, 10 };
+    static const unsigned au_kbytes[] = {
+        0, 16, 32, 64, 128, 256, 512, 1024, 2048, 4096,
+        8192, 12288, 16384, 24576, 32768, 65536,
+    };
+    unsigned n;
+
+    n = reg_bits(ssr, 512, 447, 440);
+    info->speed_class = (n < 5) ? speed_class[n] : 0;
+    info->au_size     = au_kbytes[reg_bits(ssr, 512, 431, 428)] * 1024;
+    info->uhs_grade   = reg_bits(ssr, 512, 399, 396);
+    info->video_class = reg_bits(ssr, 512, 391, 384);
+    info->app_class   = reg_bits(ssr, 512, 339, 336);
+}
+
+/*
+ * Get identity and speed information of the SD card.
+ */
+void get_card_info(struct udev_device *mmc, struct device_info *info)
+{
+    char ssr[160];
+
+    sysattr_string(mmc, "cid", info->cid, sizeof(info->cid));
+    sysattr_string(mmc, "csd", info->csd, sizeof(info->csd));
+    sysattr_string(mmc, "date", info->date, sizeof(info->date));
+
+    /* SD Status register is exported by Linux 5.9 and later. */
+    sysattr_string(mmc, "ssr", ssr, sizeof(ssr));
+    if (ssr[0])
+        parse_ssr(ssr, info);
+}
+
+/*
+ * Add a disk on the "mmc" bus to the list of devices.
+ * Skip eMMC chips and their boot/rpmb areas, partitions, empty slots
+ * and the root disk.
+ */
+void add_mmc_device(struct udev_device *dev, struct udev_device *mmc,
+    const char *root_disk, struct device_info *info, int *ndev)
+{
+    const char *devtype = udev_device_get_devtype(dev);
+    if (! devtype || strcmp(devtype, "disk") != 0)
+        return;
+
+    const char *sysname = udev_device_get_sysname(dev);
+    if (strstr(sysname, "boot") || strstr(sysname, "rpmb"))
+        return;
+
+    if (root_disk && strcmp(udev_device_get_syspath(dev), root_disk) == 0)
+        return;
+
+    /* Card type is one of "SD", "MMC" or "SDIO". */
+    const char *type = udev_device_get_sysattr_value(mmc, "type");
+    if (! type || strcmp(type, "SD") != 0)
+        return;
+
+    /* Get the disk size in 512-byte blocks. */
+    unsigned long long size = sysattr_number(dev, "size");
+    if (size == 0)
+        return;
+
+    memset(info, 0, sizeof(*info));
+    snprintf(info->devnode, sizeof(info->devnode), "%s",
+        udev_device_get_devnode(dev));
+    info->size = size * 512;
+    strcpy(info->bus, "mmc");
+    sysattr_string(mmc, "manfid", info->vendor, sizeof(info->vendor));
+    sysattr_string(mmc, "name", info->product, sizeof(info->product));
+    sysattr_string(mmc, "serial", info->serial, sizeof(info->serial));
+    get_queue_info(dev, info);
+    get_card_info(mmc, info);
+
+    /* Bus timing is a property of the host controller, like "mmc0". */
+    struct udev_device *host = udev_device_get_parent(mmc);
+    if (host)
+        mmc_bus_timing(udev_device_get_sysname(host),
+            info->bus_timing, sizeof(info->bus_timing));
+
+    sprintf(info->desc, "%s - %s %s, size %llu MB, %s",
+        info->devnode, type, info->product[0] ? info->product : "card",
+        size/2000, info->bus_timing[0] ? info->bus_timing : "timing unknown");
+    (*ndev)++;
+}
+#endif
+
+/*
+ * Estimate a max data rate allowed by the link to the card, in MB/sec.
+ * Protocol overhead is taken into account.
+ * Return 0 when unknown.
+ */
+double link_throughput(const struct device_info *info)
+{
+    if (strcmp(info->bus, "usb") == 0) {
+        if (info->link_mbps >= 10000)
+            return 800;                 /* USB 3.1 Gen 2 */
+        if (info->link_mbps >= 5000)
+            return 400;                 /* USB 3.0 */
+        if (info->link_mbps >= 480)
+            return 35;                  /* USB 2.0 High Speed */
+        if (info->link_mbps >= 12)
+            return 1;                   /* USB 1.1 Full Speed */
+        if (info->link_mbps > 0)
+            return 0.1;                 /* USB 1.0 Low Speed */
+    }
+    if (strcmp(info->bus, "mmc") == 0) {
+        if (strstr(info->bus_timing, "SDR104"))
+            return 90;
+        if (strstr(info->bus_timing, "SDR50") || strstr(info->bus_timing, "DDR50"))
+            return 45;
+        if (strstr(info->bus_timing, "SDR25") || strstr(info->bus_timing, "high-speed"))
+            return 23;
+        if (strstr(info->bus_timing, "SDR12") || strstr(info->bus_timing, "legacy"))
+            return 11;
+    }
+    return 0;
+}
+
+/*
+ * Get a minimal sustained write rate guaranteed by the card, in MB/sec.
+ * Return 0 when unknown.
+ */
+double card_throughput(const struct device_info *info)
+{
+    unsigned rate = info->speed_class;
+
+    if (info->uhs_grade * 10 > rate)
+        rate = info->uhs_grade * 10;
+    if (info->video_class > rate)
+        rate = info->video_class;
+    return rate;
+}
+
+/*
+ * Get a short description of the card speed, like "Class 10, U3, V30, A2".
+ */
+void describe_card(const struct device_info *info, char *buf, int maxlen)
+{
+    int len = 0;
+
+    buf[0] = 0;
+    if (info->speed_class > 0)
+        len += snprintf(buf + len, maxlen - len, ", Class %u", info->speed_class);
+    if (info->uhs_grade > 0 && len < maxlen)
+        len += snprintf(buf + len, maxlen - len, ", U%u", info->uhs_grade);
+    if (info->video_class > 0 && len < maxlen)
+        len += snprintf(buf + len, maxlen - len, ", V%u", info->video_class);
+    if (info->app_class > 0 && len < maxlen)
+        len += snprintf(buf + len, maxlen - len, ", A%u", info->app_class);
+    if (info->au_size > 0 && len < maxlen)
+        len += snprintf(buf + len, maxlen - len, ", AU %u kbytes", info->au_size / 1024);
+    if (info->date[0] && len < maxlen)
+        snprintf(buf + len, maxlen - len, ", made %s", info->date);
+
+    /* Skip leading comma. */
+    if (buf[0])
+        memmove(buf, buf + 2, strlen(buf + 2) + 1);
+}
+
+/*
+ * Get a short description of the link to the card.
+ */
+void describe_link(const struct device_info *info, char *buf, int maxlen)
+{
+    if (info->link_mbps > 0)
+        snprintf(buf, maxlen, "USB %s, %u Mbps",
+            info->usb_version[0] ? info->usb_version : "?", info->link_mbps);
+    else if (info->bus_timing[0])
+        snprintf(buf, maxlen, "%s", info->bus_timing);
+    else
+        snprintf(buf, maxlen, "unknown");
+}
+
+/*
+ * Check whether the link is known to be slower than requested by --min-rate.
+ */
+int link_too_slow(const struct device_info *info)
+{
+    double rate = link_throughput(info);
+
+    return min_rate > 0 && rate > 0 && rate < min_rate;
+}
+
+/*
+ * Sort devices by link speed, fastest first.
+ * Devices with unknown link speed keep their order.
+ */
+void sort_devices(struct device_info devtab[], int ndev)
+{
+    struct device_info tmp;
+    int i, k;
+
+    for (i=1; i<ndev; i++) {
+        for (k=i; k>0; k--) {
+            if (link_throughput(&devtab[k]) <= link_throughput(&devtab[k-1]))
+                break;
+            tmp = devtab[k];
+            devtab[k] = devtab[k-1];
+            devtab[k-1] = tmp;
+        }
+    }
+}
+
+#define TYPICAL_CARD_RATE 40           /* Sequential write of UHS-I card, MB/sec */
+
+/*
+ * Print expected duration of the job, as limited by the link to the card.
+ * Warn when the link is likely to be a bottleneck.
+ */
+void print_estimate(unsigned long long nbytes)
+{
+    double rate = link_throughput(&target_info);
+    double card_rate = card_throughput(&target_info);
+    unsigned seconds;
+    char link[200], card[200];
+
+    describe_card(&target_info, card, sizeof(card));
+    if (card[0])
+        printf("       Card: %s\n", card);
+    if (rate <= 0)
+        return;
+
+    describe_link(&target_info, link, sizeof(link));
+    seconds = nbytes / 1000000.0 / rate + 0.5;
+    printf("   Estimate: %u min %02u sec or more, link %s\n",
+        seconds / 60, seconds % 60, link);
+
+    if (card_rate > 0) {
+        /* Speed class guarantees a minimal write rate. */
+        if (rate < card_rate)
+            printf("Warning: link is limited to %.1f MB/sec, the card can write %.0f MB/sec.\n",
+                rate, card_rate);
+        return;
+    }
+
+    /* Modern UHS-I cards write 40 to 90 MB/sec sequentially,
+     * so a USB 2.0 link is the bottleneck. */
+    if (rate < TYPICAL_CARD_RATE)
+        printf("Warning: link is limited to %.1f MB/sec, the card is likely to be faster.\n",
+            rate);
+}
+
+/*
+ * Get a list of SD card devices.
+ * Return a number of devices found.
+ */
+int get_devices(struct device_info devtab[], int maxdev)
+{
+    int ndev = 0;
+
+#if defined(__linux__)
+    /*
+     * Create the udev object.
+     */
+    struct udev *udev = udev_new();
+    if (! udev) {
+        printf("Can't create udev\n");
+        quit(0);
+    }
+
+    /*
+     * Create a list of the devices in the 'block' subsystem.
+     */
+    struct udev_enumerate *enumerate = udev_enumerate_new(udev);
+    udev_enumerate_add_match_subsystem(enumerate, "block");
+    udev_enumerate_scan_devices(enumerate);
+
+    struct udev_list_entry *devices = udev_enumerate_get_list_entry(enumerate);
+
+    /* Never offer the disk we are running from. */
+    char *root_disk = get_root_disk(udev);
+
+    /*
+     * For each item enumerated, print out its information.
+     */
+    struct udev_list_entry *dev_list_entry;
+    udev_list_entry_foreach(dev_list_entry, devices) {
+        if (ndev >= maxdev)
+            break;
+
+        /*
+         * Get the filename of the /sys entry for the device
+         * and create a udev_device object (dev) representing it.
+         */
+        const char *path = udev_list_entry_get_name(dev_list_entry);
+        struct udev_device *dev = udev_device_new_from_syspath(udev, path);
+
+        /*
+         * Get the parent device with the subsystem/devtype pair
+         * of "usb"/"usb_device".
+         */
+        struct udev_device *usb = udev_device_get_parent_with_subsystem_devtype(dev,
+               "usb", "usb_device");
+        if (! usb) {
+            /*
+             * Not a USB device: check for a built-in SD card reader,
+             * attached to the "mmc" bus (/dev/mmcblkN).
+             */
+            struct udev_device *mmc = udev_device_get_parent_with_subsystem_devtype(dev,
+                   "mmc", NULL);
+            if (mmc)
+                add_mmc_device(dev, mmc, root_disk, &devtab[ndev], &ndev);
+            continue;
+        }
+
+        if (root_disk && strcmp(path, root_disk) == 0) {
+            continue;
+        }
+
+        /* Get the 'removable' attribute. */
+        const char *removable = udev_device_get_sysattr_value(dev, "removable");
+        if (! removable || *removable != '1') {
+            continue;
+        }
+
+        /* Get the disk size in 512-byte blocks. */
+        unsigned long long size = sysattr_number(dev, "size");
+        if (size == 0) {
+            /* SD reader without SD card inserted. */
+            continue;
+        }
+
+        /* Get the path to the device node in /dev. */
+        const char *devpath = udev_device_get_devnode(dev);
+
+        /* From here, we can call get_sysattr_value() for each file
+         * in the device's /sys entry. The strings passed into these
+         * functions (idProduct, idVendor, serial, etc.) correspond
+         * directly to the files in the directory which represents
+         * the USB device. Note that USB strings are Unicode, UCS2
+         * encoded, but the strings returned from
+         * udev_device_get_sysattr_value() are UTF-8 encoded.
+         */
+        struct device_info *info = &devtab[ndev];
+        memset(info, 0, sizeof(*info));
+        snprintf(info->devnode, sizeof(info->devnode), "%s", devpath);
+        info->size = size * 512;
+        strcpy(info->bus, "usb");
+        sysattr_string(usb, "manufacturer", info->vendor, sizeof(info->vendor));
+        sysattr_string(usb, "product", info->product, sizeof(info->product));
+        sysattr_string(usb, "serial", info->serial, sizeof(info->serial));
+        info->link_mbps = sysattr_number(usb, "speed");
+        sysattr_string(usb, "version", info->usb_version, sizeof(info->usb_version));
+        get_queue_info(dev, info);
+
+        sprintf(info->desc, "%s - %s %s, size %llu MB",
+            devpath, info->vendor, info->product, size/2000);
+        if (info->usb_version[0])
+            sprintf(info->desc + strlen(info->desc), ", USB %s", info->usb_version);
+        udev_device_unref(usb);
+        ndev++;
+    }
+
+    /* Free the enumerator object */
+    free(root_disk);
+    udev_enumerate_unref(enumerate);
+    udev_unref(udev);
+
+#elif defined(__APPLE__)
+    /*
+     * Create a list of the devices in the 'IOMedia' class.
+     */
+    CFMutableDictionaryRef dict = IOServiceMatching(kIOMediaClass);
+    if (! dict) {
+        printf("Cannot create IO Service dictionary.\n");
+        return 0;
+    }
+
+    /*
+     * Select devices with attributes Removeable=True and Whole=True.
+     */
+    CFDictionarySetValue(dict, CFSTR(kIOMediaRemovableKey), kCFBooleanTrue);
+    CFDictionarySetValue(dict, CFSTR(kIOMediaWholeKey), kCFBooleanTrue);
+
+    io_iterator_t devices = IO_OBJECT_NULL;
+    kern_return_t result = IOServiceGetMatchingServices(kIOMasterPortDefault,
+        dict, &devices);
+    if (result != KERN_SUCCESS) {
+        printf("Cannot find matching IO services.\n");
+        return 0;
+    }
+
+    /*
+     * For each matching device, print out its information.
+     */
+    io_object_t device;
+    while ((device = IOIteratorNext(devices)) != MACH_PORT_NULL) {
+        if (ndev >= maxdev)
+            break;
+
+        /*
+         * Get device path.
+         */
+        char devname[1024] = "/dev/r";
+        CFStringRef ref = (CFStringRef) IORegistryEntrySearchCFProperty(device,
+            kIOServicePlane, CFSTR(kIOBSDNameKey),
+            kCFAllocatorDefault, kIORegistryIterateRecursively);
+        if (! ref || ! CFStringGetCString(ref, devname + 6,
+            sizeof(devname) - 6, kCFStringEncodingUTF8)) {
+            /* Cannot get device path. */
+            continue;
+        }
+
+        /*
+         * Get device size in bytes.
+         */
+        long long size;
+        ref = IORegistryEntryCreateCFProperty(device,
+            CFSTR(kIOMediaSizeKey), kCFAllocatorDefault, 0);
+        if (! ref || ! CFNumberGetValue((CFNumberRef)ref, kCFNumberLongLongType, &size)) {
+            /* Cannot get device size. */
+            continue;
+        }
+
+        /*
+         * Get a list of device characteristics.
+         */
+        CFMutableDictionaryRef dict = (CFMutableDictionaryRef)
+            IORegistryEntrySearchCFProperty(device, kIOServicePlane,
+            CFSTR(kIOPropertyDeviceCharacteristicsKey),
+            kCFAllocatorDefault, kIORegistryIterateParents | kIORegistryIterateRecursively);
+        if (! dict) {
+            /* Cannot get device characteristics. */
+            continue;
+        }
+
+        /*
+         * Get vendor and product names.
+         */
+        char vendor[1024], product[1024];
+        ref = CFDictionaryGetValue(dict, CFSTR(kIOPropertyVendorNameKey));
+        if (! ref || ! CFStringGetCString(ref, vendor,
+            sizeof(vendor), kCFStringEncodingUTF8)) {
+            /* Cannot get vendor name. */
+            continue;
+        }
+        ref = CFDictionaryGetValue(dict, CFSTR(kIOPropertyProductNameKey));
+        if (! ref || ! CFStringGetCString(ref, product,
+            sizeof(product), kCFStringEncodingUTF8)) {
+            /* Cannot get product name. */
+            continue;
+        }
+
+        struct device_info *info = &devtab[ndev];
+        memset(info, 0, sizeof(*info));
+        snprintf(info->devnode, sizeof(info->devnode), "%s", devname);
+        info->size = size;
+        snprintf(info->vendor, sizeof(info->vendor), "%s", vendor);
+        snprintf(info->product, sizeof(info->product), "%s", product);
+        sprintf(info->desc, "%s - size %u MB, %s %s",
+            devname, (unsigned) (size / 1000000), vendor, product);
+        IOObjectRelease(device);
+        ndev++;
+    }
+
+    /* Free the iterator object */
+    IOObjectRelease(devices);
+#elif defined(MINGW32)
+    /*
+     * Create a list of the removable USB disk devices.
+     */
+
+    /* Get a bitmask of available drives (bit 0 = A:, bit 1 = B:, etc). */
+    unsigned drive_mask = GetLogicalDrives();
+    int i;
+
+    for (i = 0; drive_mask != 0 && ndev < maxdev; i++, drive_mask >>= 1) {
+        if (! (drive_mask & 1))
+            continue;
+
+        char drive_char = 'A' + i;
+        char drive_name[] = "\\\\.\\A:\\";
+        drive_name[4] = drive_char;
+
+        int drive_type = GetDriveType(drive_name);
+        if (drive_type != DRIVE_REMOVABLE)
+            continue;
+
+        drive_name[6] = 0;
+        HANDLE h = CreateFile(drive_name, FILE_READ_ATTRIBUTES,
+            FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+            OPEN_EXISTING, 0, NULL);
+        if (h == INVALID_HANDLE_VALUE)
+            continue;
+
+        /* Ensure that the drive is actually accessible.
+         * Multi-card hubs were reporting "removable" even when empty. */
+        DWORD dwOutBytes;
+        if (! DeviceIoControl(h, IOCTL_STORAGE_CHECK_VERIFY2,
+                NULL, 0, NULL, 0, &dwOutBytes, NULL))
+        {
+            /* IOCTL_STORAGE_CHECK_VERIFY2 fails on some devices under XP/Vista.
+             * Try the other (slower) method, just in case. */
+            HANDLE g = CreateFile(drive_name, FILE_READ_DATA,
+                FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                OPEN_EXISTING, 0, NULL);
+            if (g == INVALID_HANDLE_VALUE) {
+                CloseHandle(h);
+                continue;
+            }
+            if (! DeviceIoControl(g, IOCTL_STORAGE_CHECK_VERIFY,
+                    NULL, 0, NULL, 0, &dwOutBytes, NULL)) {
+                CloseHandle(g);
+                CloseHandle(h);
+                continue;
+            }
+            CloseHandle(g);
+        }
+
+        char sdbuf[sizeof(STORAGE_DEVICE_DESCRIPTOR) + 512 - 1];
+        PSTORAGE_DEVICE_DESCRIPTOR sd = (void*) sdbuf;
+        sd->Size = sizeof(sdbuf);
+
+        STORAGE_PROPERTY_QUERY query;
+        query.PropertyId = StorageDeviceProperty;
+        query.QueryType = PropertyStandardQuery;
+        if (! DeviceIoControl(h, IOCTL_STORAGE_QUERY_PROPERTY,
+                            &query, sizeof(STORAGE_PROPERTY_QUERY), sd,
+                            sd->Size, &dwOutBytes, NULL)) {
+            CloseHandle(h);
+            continue;
+        }
+        if (sd->BusType != BusTypeUsb) {
+            CloseHandle(h);
+            continue;
+        }
+
+        /* Get the device number. */
+        typedef struct _DEVICE_NUMBER {
+            DEVICE_TYPE  DeviceType;
+            ULONG  DeviceNumber;
+            ULONG  PartitionNumber;
+        } DEVICE_NUMBER;
+        DEVICE_NUMBER dev_num;
+        if (! DeviceIoControl(h, IOCTL_STORAGE_GET_DEVICE_NUMBER,
+                              NULL, 0, &dev_num, sizeof(DEVICE_NUMBER),
+                              &dwOutBytes, NULL)) {
+            CloseHandle(h);
+            continue;
+        }
+
+        DISK_GEOMETRY_EX geom;
+        if (! DeviceIoControl(h, IOCTL_DISK_GET_DRIVE_GEOMETRY_EX, NULL, 0,
+                &geom, sizeof(geom), &dwOutBytes, NULL)) {
+            CloseHandle(h);
+            continue;
+        }
+        unsigned mbytes = geom.DiskSize.QuadPart / 1000000;
+        CloseHandle(h);
+
+        struct device_info *info = &devtab[ndev];
+        memset(info, 0, sizeof(*info));
+        sprintf(info->devnode, "\\\\.\\PhysicalDrive%u",
+            (unsigned) dev_num.DeviceNumber);
+        info->size = geom.DiskSize.QuadPart;
+        info->logical_block = geom.Geometry.BytesPerSector;
+        strcpy(info->bus, "usb");
+        sprintf(info->desc, "%s - Disk %c: size %u MB",
+            info->devnode, drive_char, mbytes);
+        ndev++;
+    }
+#else
+    printf("Don't know how to get the list of CD devices on this system.\n");
+#endif
+
+    sort_devices(devtab, ndev);
+    return ndev;
+}
+
+/*
+ * Find a device by name, and get its properties.
+ * Return 0 when not found.
+ */
+int find_device(const char *name, struct device_info *result)
+{
+    struct device_info devices[MAXDEV];
+    int ndev, i;
+
+    ndev = get_devices(devices, MAXDEV);
+    for (i=0; i<ndev; i++) {
+        if (strcmp(devices[i].devnode, name) == 0) {
+            *result = devices[i];
+            return 1;
+        }
+    }
+    return 0;
+}
+
+#ifdef MINGW32
+/*
+ * Lock a filesystem while writing to the disk.
+ * Windows-specific action.
+ */
+void lock_volume(int volume_id)
+{
+    char name[] = "\\\\.\\A:";
+    name[4] += volume_id;
+
+    /* Open volume. */
+    HANDLE h = CreateFile(name, GENERIC_WRITE,
+        FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+    if (h == INVALID_HANDLE_VALUE) {
+        printf("Failed to open volume %s\n", name);
+        return;
+    }
+
+    /* Lock volume. */
+    DWORD nbytes;
+    if (! DeviceIoControl(h, FSCTL_LOCK_VOLUME, NULL, 0, NULL, 0, &nbytes, NULL)) {
+        printf("Failed to lock volume %s\n", name);
+        CloseHandle(h);
+        return;
+    }
+
+    /* Unmount volume. */
+    if (! DeviceIoControl(h, FSCTL_DISMOUNT_VOLUME, NULL, 0, NULL, 0, &nbytes, NULL)) {
+        printf("Failed to dismount volume %s\n", name);
+    }
+}
+#endif
+
+/*
+ * Ask for a name of the target device.
+ */
+const char *ask_device()
+{
+    struct device_info devices[MAXDEV];
+    char reply[100];
+    int ndev, i;
+
+    ndev = get_devices(devices, MAXDEV);
+
+    /* Refuse devices with slow links. */
+    for (i=0; i<ndev; ) {
+        if (link_too_slow(&devices[i])) {
+            char link[200];
+
+            describe_link(&devices[i], link, sizeof(link));
+            printf("Skip %s: link %s is too slow.\n", devices[i].devnode, link);
+            memmove(&devices[i], &devices[i+1], (ndev - i - 1) * sizeof(devices[0]));
+            ndev--;
+            continue;
+        }
+        i++;
+    }
+    if (ndev == 0) {
+        printf("No removable USB disks or SD cards available.\n");
+        quit(0);
+    }
+
+    for (;;) {
+        printf("\n");
+        for (i=0; i<ndev; i++) {
+            printf("  %c. %s\n", '1'+i, devices[i].desc);
+        }
+        printf("  q. Cancel\n");
+
+        printf("\nSelect disk device ");
+        if (ndev > 1)
+            printf("(1-%c, q): ", '0'+ndev);
+        else
+            printf("(1, q): ");
+        fflush(stdout);
+
+        if (! fgets(reply, sizeof(reply), stdin)) {
+            quit(0);
+        }
+        if (*reply == 'q' || *reply == 'Q') {
+            printf("Cancelled.\n");
+            quit(0);
+        }
+        if (*reply >= '1' && *reply < '1'+ndev) {
+            struct device_info *info = &devices[*reply - '1'];
+#ifdef MINGW32
+            char *q = strchr(info->desc, ':');
+            if (q)
+                lock_volume(q[-1] - 'A');
+#endif
+            printf("\n");
+            target_info = *info;
+            return strdup(info->devnode);
+        }
+        printf("\nEnter 1");
+        if (ndev > 1)
+            printf("...%c", '0'+ndev);
+        printf(" to select a device,\n");
+        printf("or `Q' to cancel the operation.\n");
+    }
+}
+
+/*
+ * Print a data mismatch.
+ */
+void print_mismatch(char *valid, char *invalid, int nbytes,
+    unsigned long long offset)
+{
+    int i;
+    unsigned char byte, expected;
+
+    for (i=0; i<nbytes; i++) {
+        expected = valid[i];
+        byte = invalid[i];
+        if (byte != expected) {
+            offset += i;
+            printf ("\nError at address 0x");
+            if ((offset >> 32) == 0)
+                printf ("%X", (unsigned) (offset & 0xffffffff));
+            else
+                printf ("%X%08X", (unsigned) (offset >> 32),
+                    (unsigned) (offset & 0xffffffff));
+            printf (": file=0x%02X, disk=0x%02X\n", expected, byte);
+            quit(0);
+        }
+    }
+}
+
+#ifdef __linux__
+/*
+ * Unmount all filesystems on the target disk, to avoid
+ * any I/O from the kernel while writing the image.
+ * With --no-unmount, refuse to write instead.
+ */
+void unmount_device(const char *name)
+{
+    struct stat st;
+    char path[64], syspath[PATH_MAX];
+    char *mounts[64];
+    int nmounts, i, failed = 0;
+
+    if (stat(name, &st) < 0 || ! S_ISBLK(st.st_mode))
+        return;
+    sprintf(path, "/sys/dev/block/%u:%u", major(st.st_rdev), minor(st.st_rdev));
+    if (! realpath(path, syspath))
+        return;
+
+    nmounts = get_mounts(syspath, mounts, 64);
+
+    /* Unmount in reverse order, nested mounts first. */
+    for (i=nmounts-1; i>=0; i--) {
+        if (no_unmount) {
+            fprintf(stderr, "%s: mounted on %s\n", name, mounts[i]);
+            failed = 1;
+        } else if (umount2(mounts[i], 0) < 0) {
+            fprintf(stderr, "Cannot unmount %s: %s\n", mounts[i], strerror(errno));
+            failed = 1;
+        } else {
+            printf("  Unmounted: %s\n", mounts[i]);
+        }
+        free(mounts[i]);
+    }
+    if (failed) {
+        fprintf(stderr, "%s: device is in use, cannot write.\n", name);
+        quit(0);
+    }
+}
+#endif
+
+/*
+ * Target of the write: a disk device, or a simulated one
+ * for benchmarking of the pipeline without a card:
+ *      null:               - discard all data
+ *      file:path           - write to a sparse file
+ *      sim:bw=40M,lat=2ms,stall=500ms/64M
+ *                          - model of a card with given bandwidth per second,
+ *                            latency per request, and periodic GC stalls
+ * Simulated targets, except file:, keep no data and cannot be verified.
+ */
+enum {
+    DISK_DEVICE,                /* Real disk device */
+    DISK_NULL,                  /* Discard all data */
+    DISK_FILE,                  /* Sparse file */
+    DISK_SIM,                   /* Model of a card */
+};
+
+/*
+ * Flags for disk_open().
+ */
+#define OPEN_EXCLUSIVE  1       /* No mounts or other users while open */
+#define OPEN_DIRECT     2       /* Bypass the page cache */
+#define OPEN_CREATE     4       /* Create or truncate file: target */
+#define OPEN_READONLY   8       /* Only read, no writes */
+
+#define SIM_SIZE        (32ULL << 30)   /* Default size of null: and sim: */
+#define DIRECT_ALIGN    4096            /* Buffer alignment for direct I/O */
+
+struct disk {
+    int type;                   /* Type of target */
+    int mode;                   /* Flags of disk_open() */
+    void *handle;               /* File descriptor, or HANDLE on Windows */
+    unsigned long long offset;  /* Current position */
+    unsigned long long end;     /* Max position written */
+    unsigned long long size;    /* Size of device or simulated target */
+    int reopened;               /* Reopened: unflushed writes may be lost */
+
+    /* Parameters of the model. */
+    double sim_bw;              /* Bandwidth, bytes per second */
+    unsigned long long sim_lat; /* Latency per request, ns */
+    unsigned long long sim_stall; /* Duration of GC stall, ns */
+    unsigned long long sim_stall_every; /* Bytes between GC stalls */
+    unsigned long long sim_busy; /* Model is busy until this time, ns */
+    unsigned long long sim_bytes; /* Bytes transferred by the model */
+    pthread_mutex_t sim_lock;   /* Model is shared by all threads */
+};
+
+/*
+ * Get a type of the target by name.
+ */
+int disk_type(const char *name)
+{
+    if (strncmp(name, "null:", 5) == 0)
+        return DISK_NULL;
+    if (strncmp(name, "file:", 5) == 0)
+        return DISK_FILE;
+    if (strncmp(name, "sim:", 4) == 0)
+        return DISK_SIM;
+    return DISK_DEVICE;
+}
+
+/*
+ * Parse a size with optional suffix K, M, G or T, like "64M".
+ */
+unsigned long long parse_size(const char *str, char **end)
+{
+    unsigned long long value = strtoull(str, end, 0);
+
+    switch (**end) {
+    case 'T': case 't': value <<= 10; /* fall through */
+    case 'G': case 'g': value <<= 10; /* fall through */
+    case 'M': case 'm': value <<= 10; /* fall through */
+    case 'K': case 'k': value <<= 10;
+        ++*end;
+    }
+    return value;
+}
+
+/*
+ * Parse a time interval with suffix ns, us, ms or s, like "2ms".
+ * Return nanoseconds.
+ */
+unsigned long long parse_time(const char *str, char **end)
+{
+    double value = strtod(str, end);
+
+    if (strncmp(*end, "ns", 2) == 0) {
+        *end += 2;
+    } else if (strncmp(*end, "us", 2) == 0) {
+        value *= 1e3;
+        *end += 2;
+    } else if (strncmp(*end, "ms", 2) == 0) {
+        value *= 1e6;
+        *end += 2;
+    } else if (**end == 's') {
+        value *= 1e9;
+        *end += 1;
+    } else {
+        value *= 1e6;               /* Milliseconds by default */
+    }
+    return value;
+}
+
+/*
+ * Parse parameters of simulated target,
+ * like "bw=40M,lat=2ms,stall=500ms/64M,size=32G".
+ */
+void sim_parse(struct disk *d, const char *params)
+{
+    const char *p = params;
+    char *end;
+
+    d->sim_bw = 20*1024*1024;
+    d->size = SIM_SIZE;
+    while (*p) {
+        if (strncmp(p, "bw=", 3) == 0) {
+            d->sim_bw = parse_size(p + 3, &end);
+        } else if (strncmp(p, "lat=", 4) == 0) {
+            d->sim_lat = parse_time(p + 4, &end);
+        } else if (strncmp(p, "stall=", 6) == 0) {
+            d->sim_stall = parse_time(p + 6, &end);
+            if (*end == '/')
+                d->sim_stall_every = parse_size(end + 1, &end);
+            else
+                d->sim_stall_every = 64*1024*1024;
+        } else if (strncmp(p, "size=", 5) == 0) {
+            d->size = parse_size(p + 5, &end);
+        } else {
+            end = (char*) p;
+        }
+        if (*end != ',' && *end != 0) {
+            fprintf(stderr, "%s: Bad parameters\n", params);
+            fprintf(stderr, "Expected: sim:bw=40M,lat=2ms,stall=500ms/64M,size=32G\n");
+            quit(0);
+        }
+        p = (*end == ',') ? end + 1 : end;
+    }
+    if (d->sim_bw <= 0) {
+        fprintf(stderr, "%s: Bad bandwidth\n", params);
+        quit(0);
+    }
+}
+
+/*
+ * Sleep until the given time stamp.
+ */
+void sleep_until(unsigned long long deadline)
+{
+    unsigned long long now = timestamp_ns();
+
+    if (deadline <= now)
+        return;
+#ifdef MINGW32
+    Sleep((deadline - now) / 1000000);
+#else
+    struct timespec ts;
+
+    ts.tv_sec = (deadline - now) / 1000000000;
+    ts.tv_nsec = (deadline - now) % 1000000000;
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR && ! interrupt_signal)
+        continue;
+#endif
+}
+
+/*
+ * Pass a request through the card model: wait for the latency,
+ * the transfer time at given bandwidth, and for GC stall
+ * when the request crosses the stall boundary.
+ * Requests from several threads are served one by one.
+ */
+void sim_request(struct disk *d, unsigned nbytes)
+{
+    unsigned long long now, start, busy;
+
+    pthread_mutex_lock(&d->sim_lock);
+    now = timestamp_ns();
+    start = (d->sim_busy > now) ? d->sim_busy : now;
+    busy = start + d->sim_lat + (unsigned long long) (nbytes / d->sim_bw * 1e9);
+    if (d->sim_stall_every > 0 &&
+        (d->sim_bytes + nbytes) / d->sim_stall_every != d->sim_bytes / d->sim_stall_every)
+        busy += d->sim_stall;
+    d->sim_busy = busy;
+    d->sim_bytes += nbytes;
+    pthread_mutex_unlock(&d->sim_lock);
+
+    sleep_until(busy);
+}
+
+/*
+ * Allocate a buffer, aligned for direct I/O.
+ * Return NULL when out of memory.
+ */
+char *try_alloc_buffer(size_t nbytes)
+{
+    void *buf;
+
+#ifdef MINGW32
+    buf = __mingw_aligned_malloc(nbytes, DIRECT_ALIGN);
+#else
+    if (posix_memalign(&buf, DIRECT_ALIGN, nbytes) != 0)
+        buf = 0;
+#endif
+    return buf;
+}
+
+/*
+ * Allocate a buffer, aligned for direct I/O.
+ */
+char *alloc_buffer(unsigned nbytes)
+{
+    char *buf = try_alloc_buffer(nbytes);
+
+    if (! buf) {
+        fprintf(stderr, "Out of memory\n");
+        quit(0);
+    }
+    return buf;
+}
+
+/*
+ * Free the buffer, allocated by alloc_buffer().
+ */
+void free_buffer(char *buf)
+{
+#ifdef MINGW32
+    __mingw_aligned_free(buf);
+#else
+    free(buf);
+#endif
+}
+
+/*
+ * Open the disk device, with flags in d->mode.
+ * Return 0 on success, or -1 with errno set.
+ */
+int device_open(struct disk *d, const char *name)
+{
+#ifdef MINGW32
+    HANDLE h;
+
+    h = CreateFile(name, GENERIC_READ |
+        ((d->mode & OPEN_READONLY) ? 0 : GENERIC_WRITE),
+        FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING,
+        (d->mode & OPEN_DIRECT) ? FILE_FLAG_NO_BUFFERING | FILE_FLAG_WRITE_THROUGH : 0,
+        NULL);
+    if (h == INVALID_HANDLE_VALUE) {
+        errno = EACCES;
+        return -1;
+    }
+    d->handle = (void*) h;
+#else
+    int dest, flags = (d->mode & OPEN_READONLY) ? O_RDONLY : O_RDWR;
+    struct stat st;
+#ifdef __linux__
+
+    /*
+     * For block devices, O_EXCL means no other exclusive opens
+     * and no mounts, until we close the device.
+     */
+    if ((d->mode & OPEN_EXCLUSIVE) && stat(name, &st) == 0 && S_ISBLK(st.st_mode))
+        flags |= O_EXCL;
+    if (d->mode & OPEN_DIRECT)
+        flags |= O_DIRECT;
+#endif
+    dest = open(name, flags);
+    if (dest < 0)
+        return -1;
+#ifdef __APPLE__
+    if (d->mode & OPEN_DIRECT)
+        fcntl(dest, F_NOCACHE, 1);
+#endif
+    if (fstat(dest, &st) == 0)
+        device_id = S_ISBLK(st.st_mode) ? st.st_rdev : st.st_dev;
+    d->handle = (void*) (intptr_t) dest;
+#endif
+    return 0;
+}
+
+/*
+ * Get size of the target in bytes.
+ */
+unsigned long long disk_size(struct disk *d)
+{
+    unsigned long long size = 0;
+
+    switch (d->type) {
+    case DISK_NULL:
+    case DISK_SIM:
+        return d->size;
+    case DISK_DEVICE:
+#ifdef MINGW32
+        {
+            GET_LENGTH_INFORMATION info;
+            DWORD nbytes;
+
+            if (DeviceIoControl((HANDLE) d->handle, IOCTL_DISK_GET_LENGTH_INFO,
+                    NULL, 0, &info, sizeof(info), &nbytes, NULL))
+                size = info.Length.QuadPart;
+            return size;
+        }
+#elif defined(__linux__)
+        if (ioctl((intptr_t) d->handle, BLKGETSIZE64, &size) == 0)
+            return size;
+#elif defined(__APPLE__)
+        {
+            uint64_t count;
+            uint32_t bsize;
+
+            if (ioctl((intptr_t) d->handle, DKIOCGETBLOCKCOUNT, &count) == 0 &&
+                ioctl((intptr_t) d->handle, DKIOCGETBLOCKSIZE, &bsize) == 0)
+                return count * bsize;
+        }
+#endif
+        /* fall through */
+    case DISK_FILE: {
+        struct stat st;
+
+        if (fstat((intptr_t) d->handle, &st) == 0)
+            size = st.st_size;
+        return size;
+    }
+    }
+    return 0;
+}
+
+/*
+ * Open the disk device.
+ */
+struct disk *disk_open(const char *name, int mode)
+{
+    struct disk *d = calloc(1, sizeof(struct disk));
+
+    if (! d) {
+        fprintf(stderr, "Out of memory\n");
+        quit(0);
+    }
+    d->type = disk_type(name);
+    d->mode = mode;
+    pthread_mutex_init(&d->sim_lock, 0);
+    switch (d->type) {
+    case DISK_NULL:
+        sim_parse(d, name + 5);
+        return d;
+    case DISK_SIM:
+        sim_parse(d, name + 4);
+        return d;
+    case DISK_FILE: {
+        /* Writing starts from empty file: zero blocks are left as holes. */
+        int fd = open(name + 5, O_BINARY |
+            ((mode & OPEN_READONLY) ? O_RDONLY : O_RDWR) |
+            ((mode & OPEN_CREATE) ? O_CREAT | O_TRUNC : 0), 0644);
+        if (fd < 0) {
+            perror(name + 5);
+            quit(0);
+        }
+        d->handle = (void*) (intptr_t) fd;
+        return d;
+    }
+    }
+    if (device_open(d, name) < 0) {
+#ifdef MINGW32
+        fprintf(stderr, "Cannot open device %s\n", name);
+        fprintf(stderr, "Administrator permissions required.\n");
+#else
+        if (errno == EBUSY)
+            fprintf(stderr, "%s: Device is busy\n", name);
+        else
+            perror(name);
+#endif
+        quit(0);
+    }
+    d->size = disk_size(d);
+    return d;
+}
+
+/*
+ * Close disk device.
+ */
+void disk_close(struct disk *d)
+{
+    switch (d->type) {
+    case DISK_DEVICE:
+#ifdef MINGW32
+        CloseHandle((HANDLE) d->handle);
+        break;
+#endif
+    case DISK_FILE:
+        /* Trailing zero blocks were skipped: extend the file. */
+        if (d->type == DISK_FILE && d->end > 0 &&
+            ftruncate((intptr_t) d->handle, d->end) < 0)
+            perror(device_name);
+        close((intptr_t) d->handle);
+        break;
+    }
+    pthread_mutex_destroy(&d->sim_lock);
+    free(d);
+}
+
+/*
+ * Transfer data to or from the target at given offset,
+ * without timing.  Can be called from several threads at once.
+ * Return 0 on success, or -1 on error with errno set.
+ */
+int disk_transfer(struct disk *d, char *buf, unsigned nbytes,
+    unsigned long long offset, int write)
+{
+    switch (d->type) {
+    case DISK_SIM:
+        sim_request(d, nbytes);
+        /* fall through */
+    case DISK_NULL:
+        if (! write)
+            memset(buf, 0, nbytes);
+        return 0;
+
+    case DISK_FILE:
+    case DISK_DEVICE:
+        /* Large requests may be done partially: continue
+         * from where the previous transfer stopped. */
+        while (nbytes > 0) {
+#ifdef MINGW32
+            HANDLE h = (d->type == DISK_DEVICE) ? (HANDLE) d->handle :
+                       (HANDLE) _get_osfhandle((intptr_t) d->handle);
+            OVERLAPPED ov;
+            DWORD count;
+            BOOL ok;
+
+            memset(&ov, 0, sizeof(ov));
+            ov.Offset = (DWORD) offset;
+            ov.OffsetHigh = (DWORD) (offset >> 32);
+            ok = write ? WriteFile(h, buf, nbytes, &count, &ov)
+                       : ReadFile(h, buf, nbytes, &count, &ov);
+            if (! ok || count == 0) {
+                errno = EIO;
+                return -1;
+            }
+#else
+            ssize_t count = write ?
+                pwrite((intptr_t) d->handle, buf, nbytes, offset) :
+                pread((intptr_t) d->handle, buf, nbytes, offset);
+            if (count < 0 && errno == EINTR)
+                continue;
+            if (count <= 0) {
+                /* Zero count means end of the device. */
+                if (count == 0)
+                    errno = write ? ENOSPC : EIO;
+                return -1;
+            }
+#endif
+            buf += count;
+            offset += count;
+            nbytes -= count;
+        }
+        break;
+    }
+    return 0;
+}
+
+/*
+ * Retry policy for failed requests: wait with exponential backoff,
+ * reopen the device when its node has disappeared, and optionally
+ * split the request into smaller pieces, to pass the bad spot.
+ */
+#define RETRY_DELAY_MSEC    20          /* First delay */
+#define RETRY_MAX_MSEC      2000        /* Max delay */
+#define RETRY_PIECE         (64*1024)   /* Size of a piece, with --retry-split */
+#define REOPEN_SEC          30          /* Wait for the node to reappear */
+
+/*
+ * Check whether the error can be transient.
+ */
+int retry_errno(int e)
+{
+    switch (e) {
+    case EIO:
+    case EAGAIN:
+    case ETIMEDOUT:
+    case ENODEV:
+    case ENXIO:
+    case ENOENT:
+    case EBADF:
+#ifdef ENOMEDIUM
+    case ENOMEDIUM:
+#endif
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Reopen the device, after its node has disappeared,
+ * like when USB reader was reset.  Wait until it reappears.
+ * Return 0 on success.
+ */
+int disk_reopen(struct disk *d, unsigned long long size)
+{
+    struct stat st;
+    int sec;
+
+    if (d->type != DISK_DEVICE)
+        return 0;
+#ifdef MINGW32
+    CloseHandle((HANDLE) d->handle);
+#else
+    close((intptr_t) d->handle);
+#endif
+    fprintf(stderr, "Waiting for %s to reappear...\n", device_name);
+    for (sec=0; sec<REOPEN_SEC && ! interrupt_signal; sec++) {
+        if (stat(device_name, &st) == 0) {
+#ifdef __linux__
+            /* Desktop may mount it again. */
+            unmount_device(device_name);
+#endif
+            if (device_open(d, device_name) == 0) {
+                if (disk_size(d) == size) {
+                    reopen_count++;
+                    d->reopened = 1;
+                    return 0;
+                }
+                fprintf(stderr, "%s: Different device, size %llu instead of %llu\n",
+                    device_name, disk_size(d), size);
+                quit(0);
+            }
+        }
+        sleep_until(timestamp_ns() + 1000000000ULL);
+    }
+    fprintf(stderr, "%s: Device did not reappear in %u seconds\n",
+        device_name, REOPEN_SEC);
+    return -1;
+}
+
+/*
+ * Retry the failed request.  Return 0 on success,
+ * or -1 with errno set, when all attempts failed.
+ */
+int disk_retry(struct disk *d, char *buf, unsigned nbytes,
+    unsigned long long offset, int write)
+{
+    unsigned attempt, done = 0, delay = RETRY_DELAY_MSEC;
+    unsigned piece = (retry_split && nbytes > RETRY_PIECE) ? RETRY_PIECE : nbytes;
+    struct stat st;
+    int error = errno;
+
+    for (attempt=1; attempt<=retry_max && retry_errno(error); attempt++) {
+        fprintf(stderr, "\n%s error at offset %llu: %s; retry %u of %u in %u msec\n",
+            write ? "Write" : "Read", offset + done, strerror(error),
+            attempt, retry_max, delay);
+        retry_count++;
+        PROBE3(retry, offset + done, attempt, device_id);
+        sleep_until(timestamp_ns() + delay * 1000000ULL);
+        delay = (delay * 2 < RETRY_MAX_MSEC) ? delay * 2 : RETRY_MAX_MSEC;
+
+        if (d->type == DISK_DEVICE &&
+            (error == ENODEV || error == ENXIO || stat(device_name, &st) < 0) &&
+            disk_reopen(d, d->size) < 0)
+            break;
+
+        /* Pieces, which succeeded, are not repeated. */
+        while (done < nbytes) {
+            unsigned n = (nbytes - done < piece) ? nbytes - done : piece;
+
+            errno = 0;
+            if (disk_transfer(d, buf + done, n, offset + done, write) < 0) {
+                error = errno ? errno : EIO;
+                break;
+            }
+            done += n;
+        }
+        if (done == nbytes)
+            return 0;
+    }
+    errno = error;
+    return -1;
+}
+
+/*
+ * Write to the disk device.
+ */
+void disk_write(struct disk *d, char *buf, unsigned nbytes)
+{
+    unsigned long long t0, offset = d->offset;
+
+    check_interrupt();
+    t0 = io_begin("write", offset);
+
+    PROBE3(write_submit, offset, nbytes, device_id);
+    __atomic_fetch_add(&bytes_written, nbytes, __ATOMIC_RELAXED);
+    errno = 0;
+    if (d->type == DISK_FILE && zero_check(buf, nbytes)) {
+        /* Skip zero blocks, to make a sparse file. */
+    } else if (disk_transfer(d, buf, nbytes, d->offset, 1) < 0 &&
+               disk_retry(d, buf, nbytes, d->offset, 1) < 0) {
+        fprintf(stderr, "%s: Write error: %s\n", device_name, strerror(errno));
+        quit(0);
+    }
+    d->offset += nbytes;
+    if (d->offset > d->end)
+        d->end = d->offset;
+
+    unsigned long long latency = io_end(&hist_write, t0);
+    PROBE4(write_complete, offset, nbytes, device_id, latency);
+}
+
+/*
+ * Read from the disk device.
+ */
+void disk_read(struct disk *d, char *buf, unsigned nbytes)
+{
+    unsigned long long t0, offset = d->offset;
+
+    check_interrupt();
+    t0 = io_begin("read", offset);
+
+    PROBE3(read_submit, offset, nbytes, device_id);
+    errno = 0;
+    if (disk_transfer(d, buf, nbytes, d->offset, 0) < 0 &&
+        disk_retry(d, buf, nbytes, d->offset, 0) < 0) {
+        fprintf(stderr, "%s: Read error: %s\n", device_name, strerror(errno));
+        quit(0);
+    }
+    d->offset += nbytes;
+
+    unsigned long long latency = io_end(&hist_read, t0);
+    PROBE4(read_complete, offset, nbytes, device_id, latency);
+}
+
+/*
+ * Wait until all data are written to the disk device.
+ * Return -1 with errno set when the data did not reach the device.
+ */
+int disk_flush(struct disk *d)
+{
+    unsigned long long t0 = io_begin("flush", d->offset);
+    int result = 0;
+
+    PROBE1(flush_begin, device_id);
+    switch (d->type) {
+    case DISK_SIM:
+        sleep_until(d->sim_busy);
+        break;
+    case DISK_DEVICE:
+#ifdef MINGW32
+        if (! FlushFileBuffers((HANDLE) d->handle)) {
+            errno = EIO;
+            result = -1;
+        }
+        break;
+#endif
+        /* fall through */
+    case DISK_FILE:
+        result = fsync((intptr_t) d->handle);
+        break;
+    }
+
+    unsigned long long latency = io_end(&hist_flush, t0);
+    PROBE3(flush_end, d->offset, device_id, latency);
+    return result;
+}
+
+/*
+ * Read a chunk of the source file, at the given offset.
+ */
+void source_read(int src, char *buf, int nbytes, unsigned long long offset,
+    const char *filename)
+{
+    unsigned long long t0 = timestamp_ns();
+    int done, count;
+
+    /* Pipes and network file systems may return less than requested. */
+    for (done=0; done<nbytes; done+=count) {
+        count = read(src, buf + done, nbytes - done);
+        if (count < 0 && errno == EINTR) {
+            count = 0;
+            continue;
+        }
+        if (count <= 0) {
+            if (count == 0)
+                fprintf(stderr, "%s: Unexpected end of file\n", filename);
+            else
+                perror(filename);
+            quit(0);
+        }
+    }
+    hist_add(&hist_source, timestamp_ns() - t0);
+    PROBE3(source_chunk, offset, nbytes, device_id);
+}
+
+/*
+ * Checkpoint journal of the write: a small state file with identity
+ * of the image and of the device, and the offset, up to which
+ * the data are known to be durable.  It is updated after flushes,
+ * and removed when the write completes.  With --resume, the write
+ * continues from the durable offset.
+ */
+#define JOURNAL_MSEC    1000            /* Min interval between updates */
+#define JOURNAL_SAMPLE  (1024*1024)     /* Bytes of the image to checksum */
+
+struct journal {
+    char image[PATH_MAX];       /* Path of the image */
+    unsigned long long image_size;
+    unsigned long long image_mtime;
+    unsigned image_crc;         /* CRC32C of head and tail of the image */
+    char device[PATH_MAX];      /* Name of the device, at the time */
+    unsigned long long device_size;
+    char serial[128];           /* Serial number of the device */
+    char cid[40];               /* Card identification register */
+    unsigned long long durable; /* Data are written up to this offset */
+};
+
+struct journal journal;         /* Current state of the write */
+int journal_active;             /* Journal file is maintained */
+unsigned long long journal_t0;  /* Time of the last update */
+
+/*
+ * Get identity of the image and of the device.
+ */
+void journal_identity(struct journal *j, const char *filename, int src,
+    struct disk *dest)
+{
+    struct stat st;
+    char *buf = malloc(JOURNAL_SAMPLE);
+    ssize_t n;
+
+    memset(j, 0, sizeof(*j));
+#ifdef MINGW32
+    if (! _fullpath(j->image, filename, sizeof(j->image)))
+#else
+    if (! realpath(filename, j->image))
+#endif
+        snprintf(j->image, sizeof(j->image), "%s", filename);
+    fstat(src, &st);
+    j->image_size = st.st_size;
+    j->image_mtime = st.st_mtime;
+    if (buf) {
+        n = read(src, buf, JOURNAL_SAMPLE);
+        if (n > 0)
+            j->image_crc = crc32c(0, buf, n);
+        if (st.st_size > JOURNAL_SAMPLE &&
+            lseek(src, st.st_size - JOURNAL_SAMPLE, SEEK_SET) >= 0) {
+            n = read(src, buf, JOURNAL_SAMPLE);
+            if (n > 0)
+                j->image_crc = crc32c(j->image_crc, buf, n);
+        }
+        lseek(src, 0, SEEK_SET);
+        free(buf);
+    }
+    snprintf(j->device, sizeof(j->device), "%s", device_name);
+    if (dest->type != DISK_FILE)
+        j->device_size = disk_size(dest);
+    snprintf(j->serial, sizeof(j->serial), "%s", target_info.serial);
+    snprintf(j->cid, sizeof(j->cid), "%s", target_info.cid);
+}
+
+/*
+ * Get default name of the journal: next to the image,
+ * with identity of the device, so that several cards can be
+ * written from one image at once.
+ */
+void journal_default_name(char *name, int maxlen, const char *filename)
+{
+    const char *id = target_info.cid[0] ? target_info.cid :
+                     target_info.serial[0] ? target_info.serial : device_name;
+    char buf[PATH_MAX];
+    int i;
+
+    snprintf(buf, sizeof(buf), "%s", id);
+    for (i=0; buf[i]; i++) {
+        if (buf[i] == '/' || buf[i] == ':' || buf[i] == '\\' || buf[i] == ' ')
+            buf[i] = '_';
+    }
+    snprintf(name, maxlen, "%s.%s.journal", filename, buf);
+}
+
+/*
+ * Save the journal, atomically: write a temporary file and rename it.
+ */
+int journal_save(const char *name, const struct journal *j)
+{
+    char tmpname[PATH_MAX];
+    FILE *fd;
+
+    snprintf(tmpname, sizeof(tmpname), "%s.tmp", name);
+    fd = fopen(tmpname, "w");
+    if (! fd)
+        return 0;
+    fprintf(fd, "sdwriter-journal 1\n");
+    fprintf(fd, "image %s\n", j->image);
+    fprintf(fd, "image_size %llu\n", j->image_size);
+    fprintf(fd, "image_mtime %llu\n", j->image_mtime);
+    fprintf(fd, "image_crc %08x\n", j->image_crc);
+    fprintf(fd, "device %s\n", j->device);
+    fprintf(fd, "device_size %llu\n", j->device_size);
+    fprintf(fd, "serial %s\n", j->serial);
+    fprintf(fd, "cid %s\n", j->cid);
+    fprintf(fd, "durable %llu\n", j->durable);
+    fflush(fd);
+    if (ferror(fd) || fsync(fileno(fd)) < 0) {
+        fclose(fd);
+        unlink(tmpname);
+        return 0;
+    }
+    fclose(fd);
+#ifdef MINGW32
+    unlink(name);
+#endif
+    return rename(tmpname, name) == 0;
+}
+
+/*
+ * Load the journal.  Return 0 when not found or not valid.
+ */
+int journal_load(const char *name, struct journal *j)
+{
+    FILE *fd = fopen(name, "r");
+    char line[PATH_MAX + 32], *value;
+    int version = 0;
+
+    if (! fd)
+        return 0;
+    memset(j, 0, sizeof(*j));
+    while (fgets(line, sizeof(line), fd)) {
+        line[strcspn(line, "\n")] = 0;
+        value = strchr(line, ' ');
+        if (! value)
+            continue;
+        *value++ = 0;
+        if (strcmp(line, "sdwriter-journal") == 0)
+            version = strtoul(value, 0, 0);
+        else if (strcmp(line, "image") == 0)
+            snprintf(j->image, sizeof(j->image), "%s", value);
+        else if (strcmp(line, "image_size") == 0)
+            j->image_size = strtoull(value, 0, 0);
+        else if (strcmp(line, "image_mtime") == 0)
+            j->image_mtime = strtoull(value, 0, 0);
+        else if (strcmp(line, "image_crc") == 0)
+            j->image_crc = strtoul(value, 0, 16);
+        else if (strcmp(line, "device") == 0)
+            snprintf(j->device, sizeof(j->device), "%s", value);
+        else if (strcmp(line, "device_size") == 0)
+            j->device_size = strtoull(value, 0, 0);
+        else if (strcmp(line, "serial") == 0)
+            snprintf(j->serial, sizeof(j->serial), "%s", value);
+        else if (strcmp(line, "cid") == 0)
+            snprintf(j->cid, sizeof(j->cid), "%s", value);
+        else if (strcmp(line, "durable") == 0)
+            j->durable = strtoull(value, 0, 0);
+    }
+    fclose(fd);
+    return version == 1;
+}
+
+/*
+ * Check that the journal belongs to the same image and device.
+ * Device is recognized by CID or serial number, when known,
+ * as the name may change after reconnecting.
+ */
+const char *journal_mismatch(const struct journal *saved, const struct journal *now)
+{
+    if (strcmp(saved->image, now->image) != 0)
+        return "image path";
+    if (saved->image_size != now->image_size ||
+        saved->image_mtime != now->image_mtime ||
+        saved->image_crc != now->image_crc)
+        return "image contents";
+    if (saved->device_size != now->device_size)
+        return "device size";
+    if (saved->durable > now->image_size)
+        return "durable offset";
+    if (saved->cid[0] || now->cid[0])
+        return strcmp(saved->cid, now->cid) != 0 ? "card CID" : 0;
+    if (saved->serial[0] || now->serial[0])
+        return strcmp(saved->serial, now->serial) != 0 ? "device serial number" : 0;
+    if (strcmp(saved->device, now->device) != 0)
+        return "device name";
+    return 0;
+}
+
+/*
+ * Record the durable offset, after a flush.
+ */
+void journal_update(unsigned long long durable, int force)
+{
+    unsigned long long now = timestamp_ns();
+
+    if (! journal_active)
+        return;
+    journal.durable = durable;
+    if (! force && now - journal_t0 < JOURNAL_MSEC * 1000000ULL)
+        return;
+    journal_t0 = now;
+    if (! journal_save(journal_filename, &journal)) {
+        fprintf(stderr, "\n%s: Cannot update journal, resume is not possible\n",
+            journal_filename);
+        journal_active = 0;
+    }
+}
+
+/*
+ * Remove the journal when the write is complete,
+ * or leave it with a hint, when the write failed.
+ */
+void journal_finish(int ok)
+{
+    if (! journal_active)
+        return;
+    journal_active = 0;
+    if (ok) {
+        unlink(journal_filename);
+        return;
+    }
+    journal_save(journal_filename, &journal);
+    if (journal.durable > 0)
+        fprintf(stderr, "\nFirst %llu bytes are written; to continue, run again with --resume\n",
+            journal.durable);
+}
+
+/*
+ * Start the journal for writing the image.
+ * With --resume, check the saved journal and get the durable offset.
+ * Return the offset to start writing from.
+ */
+unsigned long long journal_start(const char *filename, int src, struct disk *dest)
+{
+    static char default_name[PATH_MAX];
+    struct journal saved;
+    const char *reason;
+
+    if (! journal_filename) {
+        journal_default_name(default_name, sizeof(default_name), filename);
+        journal_filename = default_name;
+    }
+    journal_identity(&journal, filename, src, dest);
+    if (resume_mode) {
+        if (! journal_load(journal_filename, &saved)) {
+            fprintf(stderr, "%s: No journal to resume from\n", journal_filename);
+            quit(0);
+        }
+        reason = journal_mismatch(&saved, &journal);
+        if (reason) {
+            fprintf(stderr, "%s: Journal does not match: different %s\n",
+                journal_filename, reason);
+            quit(0);
+        }
+        journal.durable = saved.durable;
+    }
+    if (! journal_save(journal_filename, &journal)) {
+        fprintf(stderr, "%s: Cannot create journal, resume will not be possible\n",
+            journal_filename);
+        return journal.durable;
+    }
+    journal_active = 1;
+    journal_t0 = timestamp_ns();
+    return journal.durable;
+}
+
+/*
+ * Before resuming, compare the last written window with the image.
+ * Return the offset to resume from: the same, or the start of the window
+ * when it differs.
+ */
+unsigned long long resume_check(int src, struct disk *dest, unsigned long long offset)
+{
+    unsigned long long window = flush_interval ? flush_interval : 16*1024*1024;
+    unsigned long long start, count;
+    char *buf, *buf2;
+    int n;
+
+    if (window > offset)
+        window = offset;
+    start = offset - window;
+    buf = malloc(block_size);
+    buf2 = malloc(block_size);
+    if (! buf || ! buf2) {
+        fprintf(stderr, "Out of memory\n");
+        quit(0);
+    }
+    lseek(src, start, SEEK_SET);
+    dest->offset = start;
+    for (count=start; count<offset; count+=n) {
+        n = (offset - count < block_size) ? offset - count : block_size;
+        source_read(src, buf, n, count, journal.image);
+        disk_read(dest, buf2, n);
+        if (block_compare(buf, buf2, n) != n) {
+            printf("     Resume: last %llu bytes differ, rewriting them\n", window);
+            offset = start;
+            break;
+        }
+    }
+    free(buf);
+    free(buf2);
+    return offset;
+}
+
+/*
+ * Copy a contents of binary file to the device.
+ */
+void write_image(const char *filename, int verify_only)
+{
+    char *buf;
+    int src, n;
+    struct disk *dest;
+    struct stat st;
+    off_t nbytes, count, start = 0;
+    unsigned long long t0, elapsed;
+
+    src = open(filename, O_RDONLY | O_BINARY);
+    if (src < 0) {
+        perror(filename);
+        quit(0);
+    }
+    if (verify_only && (disk_type(device_name) == DISK_NULL ||
+                        disk_type(device_name) == DISK_SIM)) {
+        fprintf(stderr, "%s: Simulated target keeps no data, cannot verify\n",
+            device_name);
+        quit(0);
+    }
+#ifdef __linux__
+    if (! verify_only && disk_type(device_name) == DISK_DEVICE)
+        unmount_device(device_name);
+#endif
+    dest = disk_open(device_name, verify_only ? 0 :
+        resume_mode ? OPEN_EXCLUSIVE : OPEN_EXCLUSIVE | OPEN_CREATE);
+    fstat(src, &st);
+    nbytes = st.st_size;
+    printf("     Source: %s\n", filename);
+    printf("Destination: %s\n", device_name);
+    printf("       Size: %.1f MB\n", nbytes / 1000000.0);
+    print_estimate(nbytes);
+
+    /*
+     * Write by whole allocation units of the card, when known.
+     * Larger requests give no gain.
+     */
+    if (target_info.au_size > 0) {
+        block_size = target_info.au_size;
+        if (block_size > MAX_REQUEST)
+            block_size = MAX_REQUEST;
+    }
+    buf = malloc(block_size);
+    if (! buf) {
+        fprintf(stderr, "Out of memory\n");
+        quit(0);
+    }
+
+    /* Journal of the write, to resume after a failure. */
+    if (! verify_only && disk_type(device_name) != DISK_NULL &&
+        disk_type(device_name) != DISK_SIM) {
+        start = journal_start(filename, src, dest);
+        if (start > 0 && resume_verify)
+            start = resume_check(src, dest, start);
+        if (resume_mode)
+            printf("     Resume: from offset %llu, %.1f MB left\n",
+                (unsigned long long) start, (nbytes - start) / 1000000.0);
+        lseek(src, start, SEEK_SET);
+        dest->offset = start;
+        dest->end = start;
+    }
+
+    t0 = timestamp_ns();
+    monitor_start();
+    if (! verify_only) {
+        off_t flushed = start;
+
+        job_start_phase("write", nbytes);
+        job_advance(start);
+        io_size = block_size;
+        for (count=start; count<nbytes; count+=n) {
+            /* Read data into buffer. */
+            n = nbytes - count;
+            if (n > io_size)
+                n = io_size;
+            source_read(src, buf, n, count, filename);
+
+            /* Write data to the disk. */
+            disk_write(dest, buf, n);
+            job_advance(n);
+
+            /* Dirty data of the old handle are gone with the device:
+             * write again from the last flush. */
+            if (dest->reopened) {
+                dest->reopened = 0;
+                fprintf(stderr, "Writing again from offset %llu\n",
+                    (unsigned long long) flushed);
+                job_rewind(count + n - flushed);
+                lseek(src, flushed, SEEK_SET);
+                dest->offset = flushed;
+                count = flushed;
+                n = 0;
+            }
+
+            /* Flush write buffers periodically, to limit
+             * the amount of dirty data in the kernel. */
+            if (flush_interval > 0 && count + n - flushed >= flush_interval) {
+                if (disk_flush(dest) < 0) {
+                    fprintf(stderr, "%s: Flush error: %s\n", device_name, strerror(errno));
+                    quit(0);
+                }
+                flushed = count + n;
+                journal_update(flushed, 0);
+            }
+        }
+        if (disk_flush(dest) < 0) {
+            fprintf(stderr, "%s: Flush error: %s\n", device_name, strerror(errno));
+            quit(0);
+        }
+        journal_update(nbytes, 1);
+        job_end_phase();
+        journal_finish(1);
+    }
+    if (verify_only) {
+        char *buf2 = malloc(block_size);
+
+        if (! buf2) {
+            fprintf(stderr, "Out of memory\n");
+            quit(0);
+        }
+
+        job_start_phase("verify", nbytes);
+        for (count=0; count<nbytes; count+=block_size) {
+            /* Read source data. */
+            n = nbytes - count;
+            if (n > block_size)
+                n = block_size;
+            source_read(src, buf, n, count, filename);
+
+            /* Read destination data. */
+            disk_read(dest, buf2, n);
+
+            /* Compare. */
+            unsigned long long t1 = timestamp_ns();
+            int mismatch = (block_compare(buf, buf2, n) != n);
+            hist_add(&hist_compare, timestamp_ns() - t1);
+            if (mismatch != 0) {
+                PROBE3(verify_mismatch, count, n, device_id);
+                fprintf(stderr, "DATA ERROR!\n");
+                print_mismatch(buf, buf2, n,
+                    lseek(src, 0, SEEK_CUR) - n);
+                quit(0);
+            }
+            job_advance(n);
+        }
+        job_end_phase();
+        free(buf2);
+    }
+    free(buf);
+    close(src);
+    disk_close(dest);
+    elapsed = timestamp_ns() - t0;
+    printf("      Speed: %.1f MB/sec\n",
+        elapsed ? (nbytes - start) * 1e3 / elapsed : 0);
+    monitor_stop();
+    if (stall_count > 0) {
+        char longest[32];
+
+        printf("     Stalls: %u, longest %s\n", stall_count, format_ns(longest, stall_max));
+    }
+    if (cliff_count > 0)
+        printf("  Slowdowns: %u\n", cliff_count);
+    if (retry_count > 0) {
+        printf("    Retries: %u", retry_count);
+        if (reopen_count > 0)
+            printf(", device reopened %u times", reopen_count);
+        printf("\n");
+    }
+
+    if (print_stats) {
+        printf("\n    Latency:      count        p50        p90        p99        max\n");
+        print_latency(&hist_write);
+        print_latency(&hist_flush);
+        print_latency(&hist_read);
+        print_latency(&hist_source);
+        print_latency(&hist_compare);
+        print_breakdown(elapsed);
+    }
+}
+
+/*
+ * Print a string in JSON format, with quotes.
+ */
+void print_json_string(FILE *fd, const char *str)
+{
+    putc('"', fd);
+    for (; *str; str++) {
+        unsigned char c = *str;
+
+        if (c == '"' || c == '\\')
+            fprintf(fd, "\\%c", c);
+        else if (c < ' ')
+            fprintf(fd, "\\u%04x", c);
+        else
+            putc(c, fd);
+    }
+    putc('"', fd);
+}
+
+/*
+ * Print a list of available devices in JSON format.
+ */
+void print_devices_json()
+{
+    struct device_info devices[MAXDEV];
+    int ndev, i;
+
+    ndev = get_devices(devices, MAXDEV);
+    printf("[");
+    for (i=0; i<ndev; i++) {
+        struct device_info *info = &devices[i];
+
+        printf("%s\n  {\"devnode\": ", i ? "," : "");
+        print_json_string(stdout, info->devnode);
+        printf(", \"size\": %llu", info->size);
+        printf(", \"vendor\": ");
+        print_json_string(stdout, info->vendor);
+        printf(", \"product\": ");
+        print_json_string(stdout, info->product);
+        printf(", \"serial\": ");
+        print_json_string(stdout, info->serial);
+        printf(",\n   \"bus\": ");
+        print_json_string(stdout, info->bus);
+        printf(", \"link_speed_mbps\": %u", info->link_mbps);
+        printf(", \"usb_version\": ");
+        print_json_string(stdout, info->usb_version);
+        printf(", \"link_rate\": %.1f", link_throughput(info));
+        printf(", \"bus_timing\": ");
+        print_json_string(stdout, info->bus_timing);
+        printf(",\n   \"cid\": ");
+        print_json_string(stdout, info->cid);
+        printf(", \"csd\": ");
+        print_json_string(stdout, info->csd);
+        printf(", \"date\": ");
+        print_json_string(stdout, info->date);
+        printf(", \"speed_class\": %u", info->speed_class);
+        printf(", \"uhs_grade\": %u", info->uhs_grade);
+        printf(", \"video_class\": %u", info->video_class);
+        printf(", \"app_class\": %u", info->app_class);
+        printf(", \"au_size\": %u", info->au_size);
+        printf(",\n   \"logical_block_size\": %u", info->logical_block);
+        printf(", \"physical_block_size\": %u", info->physical_block);
+        printf(", \"max_sectors_kb\": %u", info->max_sectors_kb);
+        printf(", \"max_hw_sectors_kb\": %u", info->max_hw_sectors_kb);
+        printf(", \"nr_requests\": %u", info->nr_requests);
+        printf(",\n   \"discard\": %s", info->discard_max ? "true" : "false");
+        printf(", \"discard_max_bytes\": %llu", info->discard_max);
+        printf(", \"mounted\": %d", info->mounted);
+        printf(", \"rotational\": %s}", info->rotational ? "true" : "false");
+    }
+    printf("%s]\n", ndev ? "\n" : "");
+}
+
+/*
+ * Print a list of available devices.
+ */
+void print_devices()
+{
+    struct device_info devices[MAXDEV];
+    int ndev, i;
+
+    ndev = get_devices(devices, MAXDEV);
+    if (ndev == 0) {
+        printf("No target disk devices available.\n");
+    } else {
+        printf("Available disk devices:\n\n");
+        for (i=0; i<ndev; i++) {
+            printf("        %s\n", devices[i].desc);
+        }
+    }
+    printf("\n");
+}
+
+/*
+ * Device benchmark: sequential write and read throughput
+ * over a matrix of request sizes and queue depths,
+ * or random 4K IOPS over the region, for application class A1/A2.
+ * Queue depth is made by worker threads, each having
+ * one request in flight on the same disk.
+ * By default, the last 64 MB of the card are used as a scratch region:
+ * the contents are saved in memory and restored afterwards.
+ */
+#define BENCH_MSEC      1000            /* Max duration of one measurement */
+#define BENCH_RANDOM_MSEC 5000          /* Duration of random measurement */
+#define BENCH_RANDOM_SIZE 4096          /* Request size for random test */
+#define BENCH_MAX_QD    32              /* Max queue depth */
+#define BENCH_MAX_SIZE  (8*1024*1024)   /* Max request size */
+
+struct bench_run {
+    struct disk *disk;
+    int write;                  /* Write or read */
+    int random;                 /* Random or sequential offsets */
+    unsigned size;              /* Request size */
+    unsigned long long start;   /* Offset of the region */
+    unsigned long long region;  /* Size of the region */
+    unsigned long long next;    /* Next offset in the region */
+    unsigned long long deadline; /* Time limit */
+    int error;                  /* Errno of failed request */
+    pthread_mutex_t lock;       /* Protects the results */
+    unsigned long long bytes;   /* Bytes transferred */
+    struct histogram latency;   /* Latency of requests */
+};
+
+struct bench_worker {
+    struct bench_run *run;
+    char *buf;                  /* Aligned buffer of max request size */
+    pthread_t thread;
+};
+
+struct bench_result {
+    int write;                  /* Write or read */
+    int random;                 /* Random or sequential offsets */
+    unsigned size;              /* Request size */
+    unsigned qd;                /* Queue depth */
+    unsigned long long bytes;   /* Bytes transferred */
+    unsigned long long elapsed; /* Time, ns */
+    unsigned long long count;   /* Number of requests */
+    unsigned long long p50, p99, p999; /* Latency, ns */
+};
+
+static const unsigned bench_sizes[] = {
+    4*1024, 16*1024, 64*1024, 256*1024, 1024*1024, 4*1024*1024, 8*1024*1024,
+};
+static const unsigned bench_depths[] = { 1, 2, 4, 8, 16, 32 };
+
+#define BENCH_NSIZES    (sizeof(bench_sizes) / sizeof(bench_sizes[0]))
+#define BENCH_NDEPTHS   (sizeof(bench_depths) / sizeof(bench_depths[0]))
+
+struct bench_result bench_results[2 * (BENCH_NSIZES + 1) * BENCH_NDEPTHS];
+unsigned bench_nresults;
+
+/*
+ * Merge samples of one histogram into another.
+ */
+void hist_merge(struct histogram *h, const struct histogram *from)
+{
+    unsigned i;
+
+    for (i=0; i<HIST_NBUCKETS; i++)
+        h->bucket[i] += from->bucket[i];
+    h->count += from->count;
+    h->total += from->total;
+    if (from->max > h->max)
+        h->max = from->max;
+}
+
+/*
+ * Pseudo-random generator: xorshift64.
+ */
+uint64_t xorshift(uint64_t *state)
+{
+    uint64_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+/*
+ * Worker thread of the benchmark: issue requests one by one,
+ * taking next offsets from the shared counter,
+ * or at random within the region.
+ */
+void *bench_worker(void *arg)
+{
+    struct bench_worker *w = arg;
+    struct bench_run *run = w->run;
+    struct histogram *latency = calloc(1, sizeof(struct histogram));
+    unsigned long long bytes = 0, offset, t0, now;
+    uint64_t seed = timestamp_ns() ^ (uintptr_t) w;
+
+    if (! latency) {
+        run->error = ENOMEM;
+        return 0;
+    }
+    while (! bench_stop) {
+        if (run->random) {
+            offset = xorshift(&seed) % (run->region / run->size) * run->size;
+        } else {
+            offset = __atomic_fetch_add(&run->next, run->size, __ATOMIC_RELAXED);
+            if (offset + run->size > run->region)
+                break;
+        }
+
+        t0 = timestamp_ns();
+        errno = 0;
+        if (disk_transfer(run->disk, w->buf, run->size,
+                run->start + offset, run->write) < 0) {
+            run->error = errno;
+            break;
+        }
+        now = timestamp_ns();
+        hist_add(latency, now - t0);
+        bytes += run->size;
+        if (now >= run->deadline)
+            break;
+    }
+
+    pthread_mutex_lock(&run->lock);
+    run->bytes += bytes;
+    hist_merge(&run->latency, latency);
+    pthread_mutex_unlock(&run->lock);
+    free(latency);
+    return 0;
+}
+
+/*
+ * Measure one cell of the matrix: given operation,
+ * request size and queue depth.
+ */
+void bench_measure(struct disk *d, struct bench_worker worker[],
+    unsigned long long start, unsigned long long region,
+    int write, int random, unsigned size, unsigned qd)
+{
+    struct bench_run *run = calloc(1, sizeof(struct bench_run));
+    struct bench_result *r = &bench_results[bench_nresults++];
+    unsigned long long t0;
+    unsigned i;
+
+    if (! run) {
+        fprintf(stderr, "Out of memory\n");
+        quit(0);
+    }
+    run->disk = d;
+    run->write = write;
+    run->random = random;
+    run->size = size;
+    run->start = start;
+    run->region = region;
+    pthread_mutex_init(&run->lock, 0);
+
+    t0 = timestamp_ns();
+    run->deadline = t0 + (random ? BENCH_RANDOM_MSEC : BENCH_MSEC) * 1000000ULL;
+    for (i=0; i<qd; i++) {
+        worker[i].run = run;
+        if (thread_create(&worker[i].thread, bench_worker, &worker[i]) != 0) {
+            fprintf(stderr, "Cannot create thread\n");
+            quit(0);
+        }
+    }
+    for (i=0; i<qd; i++)
+        pthread_join(worker[i].thread, 0);
+    if (write && run->error == 0 && disk_flush(d) < 0)
+        run->error = errno;
+
+    r->write = write;
+    r->random = random;
+    r->size = size;
+    r->qd = qd;
+    r->bytes = run->bytes;
+    r->elapsed = timestamp_ns() - t0;
+    r->count = run->latency.count;
+    r->p50 = hist_percentile(&run->latency, 0.50);
+    r->p99 = hist_percentile(&run->latency, 0.99);
+    r->p999 = hist_percentile(&run->latency, 0.999);
+    if (run->error != 0) {
+        fprintf(stderr, "\n%s: %s error at size %u, QD %u: %s\n", device_name,
+            write ? "Write" : "Read", size, qd, strerror(run->error));
+        bench_stop = 1;
+    }
+    pthread_mutex_destroy(&run->lock);
+    free(run);
+}
+
+/*
+ * Format a request size, like "64K".
+ */
+char *format_size(char *buf, unsigned long long nbytes)
+{
+    if (nbytes >= 1024*1024*1024 && nbytes % (1024*1024*1024) == 0)
+        sprintf(buf, "%lluG", nbytes >> 30);
+    else if (nbytes >= 1024*1024 && nbytes % (1024*1024) == 0)
+        sprintf(buf, "%lluM", nbytes >> 20);
+    else if (nbytes >= 1024 && nbytes % 1024 == 0)
+        sprintf(buf, "%lluK", nbytes >> 10);
+    else
+        sprintf(buf, "%llu", nbytes);
+    return buf;
+}
+
+/*
+ * Run the matrix for one operation and print a table of throughput.
+ */
+void bench_matrix(struct disk *d, struct bench_worker worker[],
+    unsigned long long start, unsigned long long region, int write)
+{
+    unsigned i, k;
+    char size[16];
+
+    if (bench_stop)
+        return;
+    printf("\n%11s", write ? "Write MB/s:" : "Read MB/s:");
+    for (k=0; k<BENCH_NDEPTHS && bench_depths[k] <= bench_qd; k++) {
+        char qd[16];
+
+        sprintf(qd, "QD%u", bench_depths[k]);
+        printf(" %7s", qd);
+    }
+    printf("\n");
+
+    for (i=0; i<BENCH_NSIZES && ! bench_stop; i++) {
+        printf("%10s:", format_size(size, bench_sizes[i]));
+        for (k=0; k<BENCH_NDEPTHS && bench_depths[k] <= bench_qd && ! bench_stop; k++) {
+            bench_measure(d, worker, start, region, write, 0,
+                bench_sizes[i], bench_depths[k]);
+
+            struct bench_result *r = &bench_results[bench_nresults - 1];
+            printf(" %7.1f", r->elapsed ? r->bytes * 1e3 / r->elapsed : 0);
+            fflush(stdout);
+        }
+        printf("\n");
+    }
+}
+
+/*
+ * Get best IOPS of random test: at queue depth 1 only, or at any.
+ */
+double bench_iops(int write, int qd1_only)
+{
+    double best = 0;
+    unsigned i;
+
+    for (i=0; i<bench_nresults; i++) {
+        struct bench_result *r = &bench_results[i];
+        double iops = r->elapsed ? r->count * 1e9 / r->elapsed : 0;
+
+        if (r->random && r->write == write && (r->qd == 1 || ! qd1_only) &&
+            iops > best)
+            best = iops;
+    }
+    return best;
+}
+
+/*
+ * Check random IOPS against the application performance class.
+ * Class A1 is measured without command queue, at depth 1;
+ * class A2 cards may use the queue.
+ */
+int bench_class_passed(int class)
+{
+    if (class == 1)
+        return bench_iops(0, 1) >= 1500 && bench_iops(1, 1) >= 500;
+    return bench_iops(0, 0) >= 4000 && bench_iops(1, 0) >= 2000;
+}
+
+/*
+ * Run random 4K test, print IOPS and latency for every queue depth,
+ * and a verdict for application classes.
+ */
+void bench_random_iops(struct disk *d, struct bench_worker worker[],
+    unsigned long long start, unsigned long long region)
+{
+    static const struct {
+        int class;
+        unsigned read, write;
+    } app_class[] = {
+        { 1, 1500, 500 },
+        { 2, 4000, 2000 },
+    };
+    int write;
+    unsigned i, k;
+
+    printf("\n %10s %10s %10s %10s %10s %10s\n",
+        "Random 4K:", "IOPS", "p50", "p99", "p99.9", "MB/s");
+    for (write=1; write>=0; write--) {
+        for (k=0; k<BENCH_NDEPTHS && bench_depths[k] <= bench_qd && ! bench_stop; k++) {
+            char label[16], p50[32], p99[32], p999[32];
+
+            bench_measure(d, worker, start, region, write, 1,
+                BENCH_RANDOM_SIZE, bench_depths[k]);
+
+            struct bench_result *r = &bench_results[bench_nresults - 1];
+            sprintf(label, "%s QD%u:", write ? "Write" : "Read", r->qd);
+            printf("%11s %10.0f %10s %10s %10s %10.2f\n", label,
+                r->elapsed ? r->count * 1e9 / r->elapsed : 0,
+                format_ns(p50, r->p50), format_ns(p99, r->p99),
+                format_ns(p999, r->p999),
+                r->elapsed ? r->bytes * 1e3 / r->elapsed : 0);
+        }
+    }
+    if (bench_stop)
+        return;
+
+    printf("\n");
+    for (i=0; i<2; i++) {
+        int qd1_only = (app_class[i].class == 1);
+
+        printf("   Class A%d: %s, read %.0f of %u, write %.0f of %u IOPS%s\n",
+            app_class[i].class,
+            bench_class_passed(app_class[i].class) ? "PASS" : "FAIL",
+            bench_iops(0, qd1_only), app_class[i].read,
+            bench_iops(1, qd1_only), app_class[i].write,
+            qd1_only ? " at QD1" : "");
+    }
+    if (target_info.app_class > 0) {
+        int class = target_info.app_class;
+
+        printf("   Declared: A%d, %s\n", class,
+            bench_class_passed(class) ? "confirmed" : "NOT confirmed");
+    }
+}
+
+/*
+ * Save benchmark results to file in JSON format.
+ */
+void bench_report(const char *filename, unsigned long long start,
+    unsigned long long region)
+{
+    FILE *fd = fopen(filename, "w");
+    unsigned i;
+
+    if (! fd) {
+        perror(filename);
+        return;
+    }
+    fprintf(fd, "{\"device\": ");
+    print_json_string(fd, device_name);
+    fprintf(fd, ", \"vendor\": ");
+    print_json_string(fd, target_info.vendor);
+    fprintf(fd, ", \"product\": ");
+    print_json_string(fd, target_info.product);
+    fprintf(fd, ", \"serial\": ");
+    print_json_string(fd, target_info.serial);
+    fprintf(fd, ", \"cid\": ");
+    print_json_string(fd, target_info.cid);
+    fprintf(fd, ",\n \"region_offset\": %llu, \"region_size\": %llu", start, region);
+    fprintf(fd, ", \"destructive\": %s", destructive ? "true" : "false");
+    if (bench_random) {
+        fprintf(fd, ", \"app_class\": %u", target_info.app_class);
+        fprintf(fd, ", \"a1_pass\": %s", bench_class_passed(1) ? "true" : "false");
+        fprintf(fd, ", \"a2_pass\": %s", bench_class_passed(2) ? "true" : "false");
+    }
+    fprintf(fd, ",\n \"%s\": [", bench_random ? "random" : "sequential");
+    for (i=0; i<bench_nresults; i++) {
+        struct bench_result *r = &bench_results[i];
+
+        fprintf(fd, "%s\n  {\"op\": \"%s\", \"size\": %u, \"qd\": %u",
+            i ? "," : "", r->write ? "write" : "read", r->size, r->qd);
+        fprintf(fd, ", \"bytes\": %llu, \"seconds\": %.3f", r->bytes, r->elapsed / 1e9);
+        fprintf(fd, ", \"mbps\": %.2f, \"iops\": %.1f",
+            r->elapsed ? r->bytes * 1e3 / r->elapsed : 0,
+            r->elapsed ? r->count * 1e9 / r->elapsed : 0);
+        fprintf(fd, ", \"lat_p50_ns\": %llu, \"lat_p99_ns\": %llu, \"lat_p999_ns\": %llu}",
+            r->p50, r->p99, r->p999);
+    }
+    fprintf(fd, "%s]}\n", bench_nresults ? "\n " : "");
+    if (fclose(fd) != 0)
+        perror(filename);
+}
+
+/*
+ * Transfer the whole region between memory and the disk.
+ */
+void bench_copy(struct disk *d, char *data, unsigned long long start,
+    unsigned long long region, int write)
+{
+    unsigned long long count;
+
+    for (count=0; count<region; count+=BENCH_MAX_SIZE) {
+        errno = 0;
+        if (disk_transfer(d, data + count, BENCH_MAX_SIZE, start + count, write) < 0) {
+            fprintf(stderr, "%s: %s error: %s\n", device_name,
+                write ? "Write" : "Read", strerror(errno));
+            if (write)
+                fprintf(stderr, "Data at offset %llu were lost.\n", start + count);
+            quit(0);
+        }
+    }
+    if (write && disk_flush(d) < 0) {
+        fprintf(stderr, "%s: Flush error: %s\n", device_name, strerror(errno));
+        fprintf(stderr, "Data at offset %llu may be lost.\n", start);
+        quit(0);
+    }
+}
+
+/*
+ * Benchmark the device.
+ */
+void bench_device()
+{
+    struct disk *d;
+    struct bench_worker worker[BENCH_MAX_QD];
+    unsigned long long disk_bytes, start, region;
+    char *saved = 0, total[32];
+    unsigned i, k;
+
+    if (disk_type(device_name) == DISK_DEVICE) {
+#ifdef __linux__
+        unmount_device(device_name);
+#endif
+    }
+    d = disk_open(device_name, OPEN_EXCLUSIVE | OPEN_DIRECT);
+    disk_bytes = disk_size(d);
+
+    /* Scratch region at the end of the disk, aligned to max request. */
+    region = (bench_size == 0 || bench_size > disk_bytes) ? disk_bytes : bench_size;
+    region &= ~(unsigned long long) (BENCH_MAX_SIZE - 1);
+    if (region == 0) {
+        fprintf(stderr, "%s: Disk is too small\n", device_name);
+        quit(0);
+    }
+    start = (disk_bytes - region) & ~(unsigned long long) (BENCH_MAX_SIZE - 1);
+    printf("  Benchmark: %s\n", device_name);
+    printf("     Region: %s at offset %llu, %s\n", format_size(total, region),
+        start, destructive ? "data will be destroyed" : "data will be restored");
+
+    /* Keep the data of the region. */
+    if (! destructive) {
+        /* Region is read and written with direct I/O. */
+        saved = try_alloc_buffer(region);
+        if (! saved) {
+            fprintf(stderr, "Out of memory, cannot save region of %s\n", total);
+            fprintf(stderr, "Use smaller --bench-size, or --destructive\n");
+            quit(0);
+        }
+        bench_copy(d, saved, start, region, 0);
+        bench_restore = 1;
+    }
+
+    /* Random data: the card must not compress or skip anything. */
+    for (i=0; i<BENCH_MAX_QD; i++) {
+        worker[i].buf = alloc_buffer(BENCH_MAX_SIZE);
+        if (i == 0) {
+            uint64_t x = timestamp_ns() | 1;
+
+            for (k=0; k<BENCH_MAX_SIZE; k+=8) {
+                xorshift(&x);
+                memcpy(worker[i].buf + k, &x, 8);
+            }
+        } else
+            memcpy(worker[i].buf, worker[0].buf, BENCH_MAX_SIZE);
+    }
+
+    if (bench_random) {
+        bench_random_iops(d, worker, start, region);
+    } else {
+        bench_matrix(d, worker, start, region, 1);
+        bench_matrix(d, worker, start, region, 0);
+    }
+
+    for (i=0; i<BENCH_MAX_QD; i++)
+        free_buffer(worker[i].buf);
+
+    if (saved) {
+        printf("\nRestoring region... ");
+        fflush(stdout);
+        bench_copy(d, saved, start, region, 1);
+        bench_restore = 0;
+        printf("done\n");
+        free_buffer(saved);
+    }
+    disk_close(d);
+
+    if (report_filename)
+        bench_report(report_filename, start, region);
+    if (bench_stop)
+        quit(0);
+}
+
+/*
+ * Check for fake capacity: counterfeit cards report a large size,
+ * but wrap around or lose data above the real capacity.
+ * Write a unique block, tagged with its offset, at logarithmic positions
+ * over the whole disk, then read them back with direct I/O.
+ * A block, which holds the tag of another position, means aliasing;
+ * a block without a valid tag means lost data.
+ * Original contents of the blocks are saved and restored.
+ */
+#define PROBE_MAGIC     "sdwriter capacity probe"
+#define PROBE_BLOCK     4096            /* Size of sentinel block */
+#define PROBE_MAXPOS    128             /* Max number of positions */
+
+/*
+ * Fill a sentinel block for given offset.
+ */
+void probe_fill(char *buf, unsigned long long offset, uint64_t nonce)
+{
+    uint64_t x = (offset ^ nonce) | 1;
+    unsigned i;
+
+    for (i=0; i<PROBE_BLOCK; i+=8) {
+        xorshift(&x);
+        memcpy(buf + i, &x, 8);
+    }
+    memcpy(buf, PROBE_MAGIC, sizeof(PROBE_MAGIC));
+    memcpy(buf + 32, &nonce, 8);
+    memcpy(buf + 40, &offset, 8);
+}
+
+/*
+ * Check the sentinel, read at given offset.
+ * Return the offset, which the block was written for,
+ * or -1 when the block is not valid.
+ */
+long long probe_check(const char *buf, uint64_t nonce, char *expect)
+{
+    unsigned long long tag;
+
+    if (memcmp(buf, PROBE_MAGIC, sizeof(PROBE_MAGIC)) != 0 ||
+        memcmp(buf + 32, &nonce, 8) != 0)
+        return -1;
+    memcpy(&tag, buf + 40, 8);
+    probe_fill(expect, tag, nonce);
+    if (memcmp(buf, expect, PROBE_BLOCK) != 0)
+        return -1;
+    return tag;
+}
+
+/*
+ * Run the capacity check.  Terminate the program when the disk is fake.
+ */
+void check_capacity()
+{
+    struct disk *d;
+    unsigned long long disk_bytes, pos[PROBE_MAXPOS], p, usable;
+    char *saved, *buf, *expect, size[16], where[16], other[16];
+    uint64_t nonce = timestamp_ns() ^ ((uint64_t) getpid() << 32);
+    unsigned npos = 0, i, nbad = 0, nerrors = 0;
+
+    if (disk_type(device_name) == DISK_NULL || disk_type(device_name) == DISK_SIM) {
+        fprintf(stderr, "%s: Simulated target keeps no data, cannot check capacity\n",
+            device_name);
+        quit(0);
+    }
+#ifdef __linux__
+    if (disk_type(device_name) == DISK_DEVICE)
+        unmount_device(device_name);
+#endif
+    d = disk_open(device_name, OPEN_EXCLUSIVE | OPEN_DIRECT);
+    disk_bytes = disk_size(d) & ~(unsigned long long) (PROBE_BLOCK - 1);
+    if (disk_bytes == 0) {
+        fprintf(stderr, "%s: Disk is too small\n", device_name);
+        quit(0);
+    }
+    usable = disk_bytes;
+
+    /* Positions: start of the disk, every power of two from 1M
+     * and midway to the next one, and the last block. */
+    pos[npos++] = 0;
+    for (p=1024*1024; p<disk_bytes - PROBE_BLOCK; p<<=1) {
+        pos[npos++] = p;
+        if (p + p/2 < disk_bytes - PROBE_BLOCK)
+            pos[npos++] = p + p/2;
+    }
+    if (disk_bytes - PROBE_BLOCK > pos[npos-1])
+        pos[npos++] = disk_bytes - PROBE_BLOCK;
+
+    printf("   Capacity: %s reported, checking %u positions... ",
+        format_size(size, disk_bytes), npos);
+    fflush(stdout);
+
+    saved = alloc_buffer(npos * PROBE_BLOCK);
+    buf = alloc_buffer(PROBE_BLOCK);
+    expect = alloc_buffer(PROBE_BLOCK);
+    errno = 0;
+    for (i=0; i<npos; i++) {
+        if (disk_transfer(d, saved + i*PROBE_BLOCK, PROBE_BLOCK, pos[i], 0) < 0) {
+            fprintf(stderr, "\n%s: Read error at offset %llu: %s\n",
+                device_name, pos[i], strerror(errno));
+            quit(0);
+        }
+    }
+
+    /* From now on, the saved data must be put back. */
+    bench_restore = 1;
+    for (i=0; i<npos && ! bench_stop; i++) {
+        probe_fill(buf, pos[i], nonce);
+        errno = 0;
+        if (disk_transfer(d, buf, PROBE_BLOCK, pos[i], 1) < 0) {
+            fprintf(stderr, "\n%s: Write error at offset %llu: %s\n",
+                device_name, pos[i], strerror(errno));
+            nerrors++;
+            break;
+        }
+    }
+    if (nerrors == 0 && disk_flush(d) < 0) {
+        fprintf(stderr, "\n%s: Flush error: %s\n", device_name, strerror(errno));
+        nerrors++;
+    }
+
+    /* Only data, read back without errors, tell about the capacity. */
+    for (i=0; i<npos && nerrors == 0 && ! bench_stop; i++) {
+        long long tag;
+
+        errno = 0;
+        if (disk_transfer(d, buf, PROBE_BLOCK, pos[i], 0) < 0) {
+            fprintf(stderr, "\n%s: Read error at offset %llu: %s\n",
+                device_name, pos[i], strerror(errno));
+            nerrors++;
+            break;
+        }
+        tag = probe_check(buf, nonce, expect);
+        if (tag == (long long) pos[i])
+            continue;
+
+        /* Lost data means the position is beyond the real capacity.
+         * Aliased positions are a multiple of the real capacity apart. */
+        if (nbad++ == 0)
+            printf("FAILED\n");
+        format_size(where, pos[i]);
+        if (tag < 0) {
+            printf("             offset %s: data lost\n", where);
+            p = pos[i];
+        } else {
+            printf("             offset %s holds data of offset %s\n",
+                where, format_size(other, tag));
+            p = (tag > pos[i]) ? tag - pos[i] : pos[i] - tag;
+        }
+        if (p < usable)
+            usable = p;
+    }
+
+    /* Put the original data back, in reverse order:
+     * on aliased disk, the lowest position gets the last word. */
+    for (i=npos; i-- > 0; ) {
+        errno = 0;
+        if (disk_transfer(d, saved + i*PROBE_BLOCK, PROBE_BLOCK, pos[i], 1) < 0)
+            fprintf(stderr, "%s: Cannot restore data at offset %llu: %s\n",
+                device_name, pos[i], strerror(errno));
+    }
+    if (disk_flush(d) < 0)
+        fprintf(stderr, "%s: Cannot restore data: %s\n", device_name, strerror(errno));
+    bench_restore = 0;
+    free_buffer(saved);
+    free_buffer(buf);
+    free_buffer(expect);
+    disk_close(d);
+
+    if (bench_stop)
+        quit(0);
+    if (nerrors > 0) {
+        fprintf(stderr, "Capacity is not checked: I/O error of the card or the reader.\n");
+        quit(0);
+    }
+    if (nbad > 0) {
+        fprintf(stderr, "Usable capacity is at most %s: the card is fake.\n",
+            format_size(where, usable));
+        quit(0);
+    }
+    printf("OK\n");
+}
+
+/*
+ * Full-surface read scan: read the whole disk at high queue depth,
+ * and make a map of throughput and read errors per region.
+ * After a read error, the request is retried by sectors,
+ * to count unreadable ones.
+ */
+#define SCAN_REGIONS    256             /* Number of regions in the map */
+#define SCAN_REQUEST    (1024*1024)     /* Size of read request */
+#define SCAN_SECTOR     4096            /* Unit of retry after error */
+#define SCAN_COLUMNS    64              /* Width of the heatmap */
+
+struct scan_region {
+    unsigned long long first;   /* Start of the first request, ns */
+    unsigned long long last;    /* End of the last request, ns */
+    unsigned long long bytes;   /* Bytes read */
+    unsigned errors;            /* Unreadable sectors */
+};
+
+struct scan_job {
+    struct disk *disk;
+    unsigned long long size;    /* Size of the disk */
+    unsigned long long region;  /* Size of a region */
+    unsigned long long next;    /* Next offset to read */
+    pthread_mutex_t lock;       /* Protects the map */
+    struct scan_region map[SCAN_REGIONS];
+};
+
+struct scan_job scan;
+
+/*
+ * Worker thread of the scan.
+ */
+void *scan_worker(void *arg)
+{
+    char *buf = arg;
+    struct histogram *latency = calloc(1, sizeof(struct histogram));
+    unsigned long long offset, t0, t1;
+    unsigned n, k, errors;
+
+    if (! latency)
+        return 0;
+    for (;;) {
+        offset = __atomic_fetch_add(&scan.next, SCAN_REQUEST, __ATOMIC_RELAXED);
+        if (offset >= scan.size || interrupt_signal)
+            break;
+        n = (scan.size - offset < SCAN_REQUEST) ? scan.size - offset : SCAN_REQUEST;
+
+        t0 = timestamp_ns();
+        errors = 0;
+        if (disk_transfer(scan.disk, buf, n, offset, 0) < 0) {
+            /* Retry by sectors. */
+            for (k=0; k<n; k+=SCAN_SECTOR) {
+                unsigned len = (n - k < SCAN_SECTOR) ? n - k : SCAN_SECTOR;
+
+                if (disk_transfer(scan.disk, buf + k, len, offset + k, 0) < 0)
+                    errors++;
+            }
+            PROBE3(scan_error, offset, errors, device_id);
+        }
+        t1 = timestamp_ns();
+        hist_add(latency, t1 - t0);
+
+        struct scan_region *r = &scan.map[offset / scan.region];
+        pthread_mutex_lock(&scan.lock);
+        if (r->first == 0 || t0 < r->first)
+            r->first = t0;
+        if (t1 > r->last)
+            r->last = t1;
+        r->bytes += n;
+        r->errors += errors;
+        pthread_mutex_unlock(&scan.lock);
+        job_advance(n);
+    }
+
+    pthread_mutex_lock(&scan.lock);
+    hist_merge(&hist_read, latency);
+    pthread_mutex_unlock(&scan.lock);
+    free(latency);
+    return 0;
+}
+
+/*
+ * Get read rate of the region, MB/sec.
+ */
+double scan_rate(const struct scan_region *r)
+{
+    return (r->last > r->first) ? r->bytes * 1e3 / (r->last - r->first) : 0;
+}
+
+/*
+ * Compare rates, for qsort.
+ */
+int scan_compare(const void *a, const void *b)
+{
+    double x = *(const double*) a, y = *(const double*) b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * Print the map as text: one symbol per region, relative
+ * to the median rate.  Regions with read errors are marked by X.
+ */
+void scan_heatmap(unsigned nregions)
+{
+    double rates[SCAN_REGIONS], median;
+    unsigned i;
+    char size[16];
+
+    for (i=0; i<nregions; i++)
+        rates[i] = scan_rate(&scan.map[i]);
+    qsort(rates, nregions, sizeof(rates[0]), scan_compare);
+    median = rates[nregions / 2];
+
+    printf("\n   Read map: one symbol per %s, relative to median %.1f MB/sec\n",
+        format_size(size, scan.region), median);
+    printf("             # - above 90%%, + - above 70%%, - - above 50%%, . - slower, X - errors\n");
+    for (i=0; i<nregions; i++) {
+        const struct scan_region *r = &scan.map[i];
+        double ratio = median > 0 ? scan_rate(r) / median : 1;
+
+        if (i % SCAN_COLUMNS == 0)
+            printf("%10lluM: ", i * scan.region >> 20);
+        putchar(r->errors ? 'X' : ratio > 0.9 ? '#' : ratio > 0.7 ? '+' :
+                ratio > 0.5 ? '-' : '.');
+        if (i % SCAN_COLUMNS == SCAN_COLUMNS - 1 || i == nregions - 1)
+            putchar('\n');
+    }
+}
+
+/*
+ * Save the map to CSV file.
+ */
+void scan_save_map(const char *filename, unsigned nregions)
+{
+    FILE *fd = fopen(filename, "w");
+    unsigned i;
+
+    if (! fd) {
+        perror(filename);
+        return;
+    }
+    fprintf(fd, "region,offset,bytes,seconds,rate,errors\n");
+    for (i=0; i<nregions; i++) {
+        const struct scan_region *r = &scan.map[i];
+
+        fprintf(fd, "%u,%llu,%llu,%.3f,%.2f,%u\n", i, i * scan.region, r->bytes,
+            (r->last - r->first) / 1e9, scan_rate(r), r->errors);
+    }
+    if (fclose(fd) != 0)
+        perror(filename);
+}
+
+/*
+ * Read the whole disk, and print a map of throughput and errors.
+ */
+void scan_device()
+{
+    pthread_t thread[BENCH_MAX_QD];
+    char *buf[BENCH_MAX_QD];
+    unsigned long long t0, elapsed;
+    unsigned i, nregions, errors = 0, bad_regions = 0;
+
+    if (disk_type(device_name) == DISK_NULL || disk_type(device_name) == DISK_SIM) {
+        fprintf(stderr, "%s: Simulated target keeps no data, cannot scan\n",
+            device_name);
+        quit(0);
+    }
+    scan.disk = disk_open(device_name, OPEN_READONLY | OPEN_DIRECT);
+    scan.size = disk_size(scan.disk);
+    if (scan.size == 0) {
+        fprintf(stderr, "%s: Disk is empty\n", device_name);
+        quit(0);
+    }
+
+    /* Regions by whole requests. */
+    scan.region = (scan.size + SCAN_REGIONS - 1) / SCAN_REGIONS;
+    scan.region = (scan.region + SCAN_REQUEST - 1) / SCAN_REQUEST * SCAN_REQUEST;
+    nregions = (scan.size + scan.region - 1) / scan.region;
+    pthread_mutex_init(&scan.lock, 0);
+
+    printf("       Scan: %s\n", device_name);
+    printf("       Size: %.1f MB, queue depth %u\n", scan.size / 1000000.0, bench_qd);
+
+    for (i=0; i<bench_qd; i++)
+        buf[i] = alloc_buffer(SCAN_REQUEST);
+    t0 = timestamp_ns();
+    monitor_start();
+    job_start_phase("scan", scan.size);
+    for (i=0; i<bench_qd; i++) {
+        if (thread_create(&thread[i], scan_worker, buf[i]) != 0) {
+            fprintf(stderr, "Cannot create thread\n");
+            quit(0);
+        }
+    }
+    for (i=0; i<bench_qd; i++)
+        pthread_join(thread[i], 0);
+    check_interrupt();
+    job_end_phase();
+    elapsed = timestamp_ns() - t0;
+    monitor_stop();
+    for (i=0; i<bench_qd; i++)
+        free_buffer(buf[i]);
+    disk_close(scan.disk);
+
+    printf("      Speed: %.1f MB/sec\n", elapsed ? scan.size * 1e3 / elapsed : 0);
+    for (i=0; i<nregions; i++) {
+        errors += scan.map[i].errors;
+        if (scan.map[i].errors > 0)
+            bad_regions++;
+    }
+    if (errors > 0)
+        printf("     Errors: %u unreadable sectors in %u regions\n", errors, bad_regions);
+    else
+        printf("     Errors: none\n");
+
+    scan_heatmap(nregions);
+    if (map_filename)
+        scan_save_map(map_filename, nregions);
+    if (print_stats) {
+        printf("\n    Latency:      count        p50        p90        p99        max\n");
+        print_latency(&hist_read);
+    }
+    if (errors > 0)
+        quit(0);
+}
+
+/*
+ * Capture of the card into an image file.
+ */
+#define CAPTURE_REQUEST (2*1024*1024)   /* Size of read request */
+#define CAPTURE_SPARE   4               /* Buffers for the writer, above queue depth */
+#define CAPTURE_BLOCK   4096            /* Unit of the block map */
+#define CAPTURE_NONE    (~0ULL)         /* No mapped range is open */
+
+struct capture_slot {
+    char *buf;
+    unsigned long long index;   /* Number of the request in this slot */
+    int ready;                  /* Data are read */
+    unsigned char digest[32];   /* Hash of the request */
+};
+
+/*
+ * External compressors, which run threads on all CPUs.
+ */
+struct compressor {
+    const char *name;
+    const char *suffix;         /* Of the compressed file */
+    const char *argv[6];        /* Command to compress stdin to stdout */
+};
+
+const struct compressor compressor_table[] = {
+    { "zstd", ".zst", { "zstd", "-q", "-T0", "-c", 0 } },
+    { "xz",   ".xz",  { "xz", "-q", "-T0", "-c", 0 } },
+    { 0 },
+};
+
+struct capture_job {
+    struct disk *disk;
+    unsigned long long size;    /* Size of the disk */
+    unsigned long long next;    /* Next request to read */
+    unsigned long long done;    /* Requests consumed by the writer */
+    unsigned nslots;            /* Number of buffers, in a ring */
+    struct capture_slot slot[BENCH_MAX_QD + CAPTURE_SPARE];
+    pthread_mutex_t lock;       /* Protects the ring */
+    pthread_cond_t wakeup;      /* Slot is read or released */
+    pthread_mutex_t retry_lock; /* Retries may reopen the device */
+    int stop;                   /* Stop the workers: error or signal */
+    int error;                  /* Read error, errno */
+    unsigned long long error_offset; /* Offset of the read error */
+
+    const char *filename;       /* Output image */
+    int out;                    /* Output file, or pipe to compressor */
+    const struct compressor *compressor; /* Compressor, or NULL */
+    char artifact[PATH_MAX];    /* Name of compressed image */
+    int artifact_fd;            /* Compressed image */
+    int pipe_fd;                /* Output of the compressor */
+    pid_t pid;                  /* Process of the compressor */
+    pthread_t drain;            /* Thread, saving the compressed data */
+    struct sha256 artifact_hash; /* Hash of compressed data */
+    unsigned long long artifact_size; /* Bytes of compressed data */
+    FILE *ranges;               /* Mapped ranges for the block map */
+    FILE *hashes;               /* Manifest of request hashes */
+    struct sha256 range_hash;   /* Hash of the current mapped range */
+    unsigned long long range_start; /* First block of the range */
+    unsigned long long mapped;  /* Count of mapped blocks */
+};
+
+struct capture_job capture;
+
+/*
+ * Worker thread of the capture: read requests in turn,
+ * into the ring of buffers, and hash them.
+ */
+void *capture_worker(void *arg)
+{
+    struct histogram *latency = calloc(1, sizeof(struct histogram));
+    unsigned long long index, offset, t0;
+    struct capture_slot *s;
+    struct sha256 ctx;
+    unsigned n;
+
+    if (! latency)
+        return 0;
+    for (;;) {
+        index = __atomic_fetch_add(&capture.next, 1, __ATOMIC_RELAXED);
+        offset = index * CAPTURE_REQUEST;
+        if (offset >= capture.size || interrupt_signal)
+            break;
+        n = (capture.size - offset < CAPTURE_REQUEST) ? capture.size - offset : CAPTURE_REQUEST;
+
+        /* Wait until the writer releases the slot. */
+        s = &capture.slot[index % capture.nslots];
+        pthread_mutex_lock(&capture.lock);
+        while (index >= capture.done + capture.nslots && ! capture.stop)
+            pthread_cond_wait(&capture.wakeup, &capture.lock);
+        pthread_mutex_unlock(&capture.lock);
+        if (capture.stop)
+            break;
+
+        t0 = timestamp_ns();
+        PROBE3(read_submit, offset, n, device_id);
+        errno = 0;
+        if (disk_transfer(capture.disk, s->buf, n, offset, 0) < 0) {
+            int failed;
+
+            pthread_mutex_lock(&capture.retry_lock);
+            failed = disk_retry(capture.disk, s->buf, n, offset, 0) < 0;
+            pthread_mutex_unlock(&capture.retry_lock);
+            if (failed) {
+                /* The main thread stops the others and reports. */
+                pthread_mutex_lock(&capture.lock);
+                if (! capture.stop) {
+                    capture.error = errno ? errno : EIO;
+                    capture.error_offset = offset;
+                }
+                capture.stop = 1;
+                pthread_cond_broadcast(&capture.wakeup);
+                pthread_mutex_unlock(&capture.lock);
+                break;
+            }
+        }
+        unsigned long long elapsed = timestamp_ns() - t0;
+        hist_add(latency, elapsed);
+        PROBE4(read_complete, offset, n, device_id, elapsed);
+
+        sha256_init(&ctx);
+        sha256_update(&ctx, s->buf, n);
+        sha256_final(&ctx, s->digest);
+
+        pthread_mutex_lock(&capture.lock);
+        s->index = index;
+        s->ready = 1;
+        pthread_cond_broadcast(&capture.wakeup);
+        pthread_mutex_unlock(&capture.lock);
+    }
+
+    pthread_mutex_lock(&capture.lock);
+    hist_merge(&hist_read, latency);
+    pthread_mutex_unlock(&capture.lock);
+    free(latency);
+    return 0;
+}
+
+/*
+ * Close the current mapped range of the block map.
+ */
+void capture_range_end(unsigned long long end)
+{
+    unsigned char digest[32];
+    char hex[65];
 
-    /* Lock volume. */
-    DWORD nbytes;
-    if (! DeviceIoControl(h, FSCTL_LOCK_VOLUME, NULL, 0, NULL, 0, &nbytes, NULL)) {
-        printf("Failed to lock volume %s\n", name);
-        CloseHandle(h);
+    if (capture.range_start == CAPTURE_NONE)
         return;
-    }
-
-    /* Unmount volume. */
-    if (! DeviceIoControl(h, FSCTL_DISMOUNT_VOLUME, NULL, 0, NULL, 0, &nbytes, NULL)) {
-        printf("Failed to dismount volume %s\n", name);
-    }
+    sha256_final(&capture.range_hash, digest);
+    sha256_hex(digest, hex);
+    if (end - 1 > capture.range_start)
+        fprintf(capture.ranges, "        <Range chksum=\"%s\"> %llu-%llu </Range>\n",
+            hex, capture.range_start, end - 1);
+    else
+        fprintf(capture.ranges, "        <Range chksum=\"%s\"> %llu </Range>\n",
+            hex, capture.range_start);
+    capture.range_start = CAPTURE_NONE;
 }
-#endif
 
 /*
- * Ask for a name of the target device.
+ * Write data to the output image.
  */
-const char *ask_device()
+void capture_write(const char *buf, unsigned nbytes, unsigned long long offset)
 {
-#define MAXDEV 9
-    char *devices[MAXDEV + 1];
-    char reply[100];
-    int ndev;
+    int n;
 
-    get_devices(devices, MAXDEV);
-    if (! devices[0]) {
-        printf("No removable USB disks avalable.\n");
-        quit(0);
+    /* Compressor gets a stream: no seeks. */
+    if (! capture.compressor && lseek(capture.out, offset, SEEK_SET) < 0)
+        goto failed;
+    while (nbytes > 0) {
+        n = write(capture.out, buf, nbytes);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            goto failed;
+        buf += n;
+        nbytes -= n;
     }
+    return;
+failed:
+    /* Compressor gets the signal as well. */
+    check_interrupt();
+    if (capture.compressor)
+        fprintf(stderr, "%s: Compressor failed\n", capture.compressor->name);
+    else
+        perror(capture.filename);
+    quit(0);
+}
 
-    for (;;) {
-        printf("\n");
-        for (ndev=0; devices[ndev]; ndev++) {
-            printf("  %c. %s\n", '1'+ndev, devices[ndev]);
-        }
-        printf("  q. Cancel\n");
+/*
+ * Process a request in order: write data blocks to the image,
+ * leaving zero blocks as holes, or pass all data to the compressor,
+ * and update the block map.
+ */
+void capture_chunk(const struct capture_slot *s, unsigned nbytes,
+    unsigned long long offset)
+{
+    unsigned k, len, run = 0;
+    int in_run = 0;
+    char hex[65];
 
-        printf("\nSelect disk device ");
-        if (ndev > 1)
-            printf("(1-%c, q): ", '0'+ndev);
-        else
-            printf("(1, q): ");
-        fflush(stdout);
+    for (k=0; k<nbytes; k+=len) {
+        unsigned long long block = (offset + k) / CAPTURE_BLOCK;
 
-        if (! fgets(reply, sizeof(reply), stdin)) {
-            quit(0);
+        len = (nbytes - k < CAPTURE_BLOCK) ? nbytes - k : CAPTURE_BLOCK;
+        if (zero_check(s->buf + k, len)) {
+            capture_range_end(block);
+            if (in_run)
+                capture_write(s->buf + run, k - run, offset + run);
+            in_run = 0;
+            continue;
         }
-        if (*reply == 'q' || *reply == 'Q') {
-            printf("Cancelled.\n");
-            quit(0);
+        if (capture.range_start == CAPTURE_NONE) {
+            capture.range_start = block;
+            sha256_init(&capture.range_hash);
         }
-        if (*reply >= '1' && *reply < '1'+ndev) {
-            char *devname = devices[*reply - '1'];
-#ifdef MINGW32
-            char *q = strchr(devname, ':');
-            if (q)
-                lock_volume(q[-1] - 'A');
-#endif
-            char *p = strchr(devname, ' ');
-            if (p)
-                *p = 0;
-            printf("\n");
-            return devname;
+        sha256_update(&capture.range_hash, s->buf + k, len);
+        capture.mapped++;
+        if (! in_run && ! capture.compressor) {
+            run = k;
+            in_run = 1;
         }
-        printf("\nEnter 1");
-        if (ndev > 1)
-            printf("...%c", '0'+ndev);
-        printf(" to select a device,\n");
-        printf("or `Q' to cancel the operation.\n");
     }
+    if (capture.compressor)
+        capture_write(s->buf, nbytes, offset);
+    else if (in_run)
+        capture_write(s->buf + run, nbytes - run, offset + run);
+
+    sha256_hex(s->digest, hex);
+    fprintf(capture.hashes, "%llu %u %s\n", offset, nbytes, hex);
 }
 
 /*
- * Print a symbol repeated.
+ * Find the compressor by name.
  */
-void print_symbols(char symbol, int cnt)
+const struct compressor *find_compressor(const char *name)
 {
-    while (cnt-- > 0)
-        putchar(symbol);
+    const struct compressor *c;
+
+    for (c=compressor_table; c->name; c++) {
+        if (strcmp(name, c->name) == 0)
+            return c;
+    }
+    fprintf(stderr, "%s: Unknown compressor, use zstd or xz\n", name);
+    quit(0);
+    return 0;
 }
 
 /*
- * Advance the progress indicator.
+ * Find the compressor by suffix of the file name, or NULL.
  */
-int progress(unsigned step)
+const struct compressor *compressor_by_suffix(const char *filename)
 {
-    ++progress_count;
-    if (progress_count % step == 0) {
-        putchar('#');
-        fflush(stdout);
-        return 1;
+    const struct compressor *c;
+    int len = strlen(filename);
+
+    for (c=compressor_table; c->name; c++) {
+        int n = strlen(c->suffix);
+
+        if (len > n && strcmp(filename + len - n, c->suffix) == 0)
+            return c;
     }
     return 0;
 }
 
+#ifndef MINGW32
 /*
- * Print a data mismatch.
+ * Thread, which saves the output of the compressor, and hashes it.
  */
-void print_mismatch(char *valid, char *invalid, int nbytes,
-    unsigned long long offset)
+void *capture_drain(void *arg)
 {
-    int i;
-    unsigned char byte, expected;
+    char *buf = malloc(CAPTURE_REQUEST);
+    int n, k, w;
 
-    for (i=0; i<nbytes; i++) {
-        expected = valid[i];
-        byte = invalid[i];
-        if (byte != expected) {
-            offset += i;
-            printf ("\nError at address 0x");
-            if ((offset >> 32) == 0)
-                printf ("%X", (unsigned) (offset & 0xffffffff));
-            else
-                printf ("%X%08X", (unsigned) (offset >> 32),
-                    (unsigned) (offset & 0xffffffff));
-            printf (": file=0x%02X, disk=0x%02X\n", expected, byte);
-            quit(0);
+    if (! buf)
+        return "Out of memory";
+    for (;;) {
+        n = read(capture.pipe_fd, buf, CAPTURE_REQUEST);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            free(buf);
+            return strerror(errno);
+        }
+        if (n == 0)
+            break;
+        sha256_update(&capture.artifact_hash, buf, n);
+        capture.artifact_size += n;
+        for (k=0; k<n; k+=w) {
+            w = write(capture.artifact_fd, buf + k, n - k);
+            if (w < 0 && errno == EINTR) {
+                w = 0;
+                continue;
+            }
+            if (w <= 0) {
+                free(buf);
+                return strerror(errno ? errno : ENOSPC);
+            }
         }
     }
+    free(buf);
+    return 0;
 }
+#endif
 
 /*
- * Open the disk device.
+ * Start the compressor: data go to its input by a pipe,
+ * and its output is saved and hashed by the drain thread.
  */
-void *disk_open(const char *name)
+void capture_compress_start()
 {
 #ifdef MINGW32
-    HANDLE h;
+    fprintf(stderr, "Compression of captured image is not supported on Windows\n");
+    quit(0);
+#else
+    int in[2], out[2];
 
-    h = CreateFile(name, GENERIC_READ | GENERIC_WRITE,
-        FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
-    if (h == INVALID_HANDLE_VALUE) {
-        fprintf(stderr, "Cannot open device %s\n", name);
-        fprintf(stderr, "Administrator permissions required.\n");
+    capture.artifact_fd = open(capture.artifact, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+    if (capture.artifact_fd < 0) {
+        perror(capture.artifact);
+        quit(0);
+    }
+    if (pipe(in) < 0 || pipe(out) < 0) {
+        perror("pipe");
         quit(0);
     }
-    return (void*) h;
-#else
-    int dest;
 
-    dest = open(name, O_RDWR);
-    if (dest < 0) {
-        perror(name);
+    /* Failed compressor is detected by write errors, not by a signal. */
+    signal(SIGPIPE, SIG_IGN);
+    capture.pid = fork();
+    if (capture.pid < 0) {
+        perror("fork");
+        quit(0);
+    }
+    if (capture.pid == 0) {
+        /* Child process. */
+        dup2(in[0], 0);
+        dup2(out[1], 1);
+        close(in[0]);
+        close(in[1]);
+        close(out[0]);
+        close(out[1]);
+        close(capture.artifact_fd);
+        execvp(capture.compressor->argv[0], (char**) capture.compressor->argv);
+        fprintf(stderr, "%s: %s\n", capture.compressor->argv[0], strerror(errno));
+        _exit(127);
+    }
+    close(in[0]);
+    close(out[1]);
+    capture.out = in[1];
+    capture.pipe_fd = out[0];
+    sha256_init(&capture.artifact_hash);
+    if (thread_create(&capture.drain, capture_drain, 0) != 0) {
+        fprintf(stderr, "Cannot create thread\n");
         quit(0);
     }
-    return (void*) (intptr_t) dest;
 #endif
 }
 
 /*
- * Close disk device.
+ * Wait for the compressor to finish, then save the checksum
+ * of the compressed image, in the format of sha256sum.
  */
-void disk_close(void *dest)
+void capture_compress_finish()
 {
-#ifdef MINGW32
-    CloseHandle((HANDLE) dest);
-#else
-    close((uintptr_t) dest);
-#endif
-}
+#ifndef MINGW32
+    unsigned char digest[32];
+    char name[PATH_MAX + 8], hex[65];
+    const char *error, *base;
+    void *result;
+    int status;
+    FILE *fd;
 
-/*
- * Write to the disk device.
- */
-void disk_write(void *dest, char *buf, unsigned nbytes)
-{
-#ifdef MINGW32
-    unsigned long nwritten;
-    if (! WriteFile((HANDLE) dest, buf, nbytes, &nwritten, NULL)) {
-        fprintf(stderr, "%s: Write error\n", device_name);
+    close(capture.out);
+    pthread_join(capture.drain, &result);
+    error = result;
+    close(capture.pipe_fd);
+    if (waitpid(capture.pid, &status, 0) < 0 ||
+        ! WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "%s: Compressor failed\n", capture.compressor->name);
         quit(0);
     }
-#else
-    if (write((uintptr_t) dest, buf, nbytes) != nbytes) {
-        fprintf(stderr, "%s: Write error\n", device_name);
+    if (error || close(capture.artifact_fd) < 0) {
+        fprintf(stderr, "%s: %s\n", capture.artifact, error ? error : strerror(errno));
         quit(0);
     }
-#endif
-}
 
-/*
- * Read from the disk device.
- */
-void disk_read(void *src, char *buf, unsigned nbytes)
-{
-#ifdef MINGW32
-    unsigned long nread;
-    if (! ReadFile((HANDLE) src, buf, nbytes, &nread, NULL)) {
-        fprintf(stderr, "%s: Write error\n", device_name);
+    sha256_final(&capture.artifact_hash, digest);
+    sha256_hex(digest, hex);
+    base = strrchr(capture.artifact, '/');
+    base = base ? base + 1 : capture.artifact;
+    snprintf(name, sizeof(name), "%s.sha256", capture.artifact);
+    fd = fopen(name, "w");
+    if (! fd) {
+        perror(name);
         quit(0);
     }
-#else
-    if (read((uintptr_t) src, buf, nbytes) != nbytes) {
-        fprintf(stderr, "%s: Read error\n", device_name);
+    fprintf(fd, "%s  %s\n", hex, base);
+    if (ferror(fd) | fclose(fd)) {
+        perror(name);
         quit(0);
     }
 #endif
 }
 
 /*
- * Wait until all data are written to the disk device.
+ * Save the block map in bmaptool format, version 2.0.
+ * The checksum of the file is computed with the field filled by zeros.
  */
-void disk_flush(void *dest)
+void capture_save_bmap(const char *name)
 {
-#ifdef MINGW32
-    FlushFileBuffers((HANDLE) dest);
-#else
-    fsync((uintptr_t) dest);
-#endif
+    unsigned long long nblocks = (capture.size + CAPTURE_BLOCK - 1) / CAPTURE_BLOCK;
+    FILE *fd = fopen(name, "w+");
+    unsigned char digest[32];
+    struct sha256 ctx;
+    char buf[4096], hex[65];
+    long checksum_pos;
+    size_t n;
+
+    if (! fd) {
+        perror(name);
+        quit(0);
+    }
+    fprintf(fd, "<?xml version=\"1.0\" ?>\n");
+    fprintf(fd, "<!-- Block map of %s, created by sdwriter from %s -->\n",
+        capture.filename, device_name);
+    fprintf(fd, "<bmap version=\"2.0\">\n");
+    fprintf(fd, "    <ImageSize> %llu </ImageSize>\n", capture.size);
+    fprintf(fd, "    <BlockSize> %u </BlockSize>\n", CAPTURE_BLOCK);
+    fprintf(fd, "    <BlocksCount> %llu </BlocksCount>\n", nblocks);
+    fprintf(fd, "    <MappedBlocksCount> %llu </MappedBlocksCount>\n", capture.mapped);
+    fprintf(fd, "    <ChecksumType> sha256 </ChecksumType>\n");
+    fprintf(fd, "    <BmapFileChecksum> ");
+    checksum_pos = ftell(fd);
+    fprintf(fd, "%064d </BmapFileChecksum>\n", 0);
+    fprintf(fd, "    <BlockMap>\n");
+    rewind(capture.ranges);
+    while ((n = fread(buf, 1, sizeof(buf), capture.ranges)) > 0)
+        fwrite(buf, 1, n, fd);
+    fprintf(fd, "    </BlockMap>\n");
+    fprintf(fd, "</bmap>\n");
+
+    /* Checksum of the whole file. */
+    fflush(fd);
+    rewind(fd);
+    sha256_init(&ctx);
+    while ((n = fread(buf, 1, sizeof(buf), fd)) > 0)
+        sha256_update(&ctx, buf, n);
+    sha256_final(&ctx, digest);
+    sha256_hex(digest, hex);
+    fseek(fd, checksum_pos, SEEK_SET);
+    fwrite(hex, 1, 64, fd);
+    if (ferror(fd) | fclose(fd)) {
+        perror(name);
+        quit(0);
+    }
 }
 
 /*
- * Copy a contents of binary file to the device.
+ * Read the whole disk into an image file, by queued direct requests.
+ * Zero blocks are left as holes.  In the same pass, a block map
+ * and a manifest of hashes are produced.
  */
-void write_image(const char *filename, int verify_only)
+void capture_image(const char *filename)
 {
-    char buf[32*1024];
-    int src, n, progress_len, progress_step;
-    void *dest;
-    struct stat st;
-    off_t nbytes, count;
-    struct timeval t0;
+    pthread_t thread[BENCH_MAX_QD];
+    unsigned long long t0, elapsed, index, offset;
+    char bmap_name[PATH_MAX], hashes_name[PATH_MAX], raw_name[PATH_MAX];
+    unsigned i, n;
 
-    src = open(filename, O_RDONLY | O_BINARY);
-    if (src < 0) {
-        perror(filename);
+    if (disk_type(device_name) == DISK_NULL || disk_type(device_name) == DISK_SIM) {
+        fprintf(stderr, "%s: Simulated target keeps no data, cannot capture\n",
+            device_name);
+        quit(0);
+    }
+#ifdef __linux__
+    if (disk_type(device_name) == DISK_DEVICE)
+        unmount_device(device_name);
+#endif
+    capture.disk = disk_open(device_name, OPEN_EXCLUSIVE | OPEN_READONLY | OPEN_DIRECT);
+    capture.size = disk_size(capture.disk);
+    if (capture.size == 0) {
+        fprintf(stderr, "%s: Disk is empty\n", device_name);
         quit(0);
     }
-    dest = disk_open(device_name);
-    fstat(src, &st);
-    nbytes = st.st_size;
-    printf("     Source: %s\n", filename);
-    printf("Destination: %s\n", device_name);
-    printf("       Size: %.1f MB\n", nbytes / 1000000.0);
 
-    /* Compute length of progress indicator. */
-    for (progress_step=1; ; progress_step<<=1) {
-        progress_len = (nbytes + sizeof(buf) - 1) / sizeof(buf);
-        if (progress_len / progress_step < 64) {
-            progress_len += progress_step - 1;
-            progress_len /= progress_step;
-            break;
+    /*
+     * Compressed image is named with suffix of the compressor;
+     * the block map and the hashes describe the raw image,
+     * and are named after it.
+     */
+    capture.compressor = compress_method ? find_compressor(compress_method) :
+                         compressor_by_suffix(filename);
+    if (capture.compressor) {
+        int len = strlen(filename) - strlen(capture.compressor->suffix);
+
+        if (compressor_by_suffix(filename) == capture.compressor) {
+            snprintf(capture.artifact, sizeof(capture.artifact), "%s", filename);
+            snprintf(raw_name, sizeof(raw_name), "%.*s", len, filename);
+        } else {
+            snprintf(capture.artifact, sizeof(capture.artifact), "%s%s",
+                filename, capture.compressor->suffix);
+            snprintf(raw_name, sizeof(raw_name), "%s", filename);
+        }
+        capture.filename = raw_name;
+        capture_compress_start();
+    } else {
+        capture.filename = filename;
+        capture.out = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+        if (capture.out < 0) {
+            perror(filename);
+            quit(0);
         }
     }
+    snprintf(bmap_name, sizeof(bmap_name), "%s.bmap", capture.filename);
+    snprintf(hashes_name, sizeof(hashes_name), "%s.hashes", capture.filename);
+    capture.hashes = fopen(hashes_name, "w");
+    if (! capture.hashes) {
+        perror(hashes_name);
+        quit(0);
+    }
+    capture.ranges = tmpfile();
+    if (! capture.ranges) {
+        perror("Temporary file");
+        quit(0);
+    }
+    fprintf(capture.hashes, "# sha256 of every %u bytes of %s: offset, length, hash\n",
+        CAPTURE_REQUEST, capture.filename);
+    capture.range_start = CAPTURE_NONE;
+    capture.nslots = bench_qd + CAPTURE_SPARE;
+    pthread_mutex_init(&capture.lock, 0);
+    pthread_cond_init(&capture.wakeup, 0);
+    pthread_mutex_init(&capture.retry_lock, 0);
+    for (i=0; i<capture.nslots; i++)
+        capture.slot[i].buf = alloc_buffer(CAPTURE_REQUEST);
 
-    progress_count = 0;
-    gettimeofday(&t0, 0);
-    if (! verify_only) {
-        printf("      Write: ");
-        print_symbols('.', progress_len);
-        print_symbols('\b', progress_len);
-        fflush(stdout);
-        for (count=0; count<nbytes; count+=sizeof(buf)) {
-            /* Read data into buffer. */
-            n = nbytes - count;
-            if (n > sizeof(buf))
-                n = sizeof(buf);
-            if (read(src, buf, n) != n) {
-                fprintf(stderr, "%s: Read error, n=%d\n", filename, n);
-                quit(0);
-            }
+    printf("     Source: %s\n", device_name);
+    printf("Destination: %s\n", capture.compressor ? capture.artifact : filename);
+    printf("       Size: %.1f MB, queue depth %u\n", capture.size / 1000000.0, bench_qd);
 
-            /* Write data to the disk. */
-            disk_write(dest, buf, n);
+    t0 = timestamp_ns();
+    monitor_start();
+    job_start_phase("capture", capture.size);
+    for (i=0; i<bench_qd; i++) {
+        if (thread_create(&thread[i], capture_worker, 0) != 0) {
+            fprintf(stderr, "Cannot create thread\n");
+            quit(0);
+        }
+    }
 
-            if (progress(progress_step)) {
-                /* Flush write buffers. */
-                disk_flush(dest);
-            }
+    /* Write requests in order, as they are read. */
+    for (index=0, offset=0; offset<capture.size; index++, offset+=n) {
+        struct capture_slot *s = &capture.slot[index % capture.nslots];
+
+        n = (capture.size - offset < CAPTURE_REQUEST) ? capture.size - offset : CAPTURE_REQUEST;
+        pthread_mutex_lock(&capture.lock);
+        if (interrupt_signal) {
+            capture.stop = 1;
+            pthread_cond_broadcast(&capture.wakeup);
         }
-        printf(" done      \n");
-        disk_flush(dest);
+        while ((! s->ready || s->index != index) && ! capture.stop)
+            pthread_cond_wait(&capture.wakeup, &capture.lock);
+        pthread_mutex_unlock(&capture.lock);
+        if (capture.stop)
+            break;
+
+        capture_chunk(s, n, offset);
+
+        pthread_mutex_lock(&capture.lock);
+        s->ready = 0;
+        capture.done++;
+        pthread_cond_broadcast(&capture.wakeup);
+        pthread_mutex_unlock(&capture.lock);
+        job_advance(n);
     }
-    if (verify_only) {
-        char buf2[sizeof(buf)];
+    for (i=0; i<bench_qd; i++)
+        pthread_join(thread[i], 0);
+    check_interrupt();
+    if (capture.error) {
+        fprintf(stderr, "\n%s: Read error at offset %llu: %s\n",
+            device_name, capture.error_offset, strerror(capture.error));
+        quit(0);
+    }
+    capture_range_end((capture.size + CAPTURE_BLOCK - 1) / CAPTURE_BLOCK);
 
-        printf("     Verify: ");
-        print_symbols('.', progress_len);
-        print_symbols('\b', progress_len);
-        fflush(stdout);
-        for (count=0; count<nbytes; count+=sizeof(buf)) {
-            /* Read source data. */
-            n = nbytes - count;
-            if (n > sizeof(buf))
-                n = sizeof(buf);
-            if (read(src, buf, n) != n) {
-                fprintf(stderr, "%s: Read error\n", filename);
-                quit(0);
-            }
+    if (capture.compressor) {
+        capture_compress_finish();
+    } else if (ftruncate(capture.out, capture.size) < 0 || close(capture.out) < 0) {
+        /* Holes at the end are kept by the size of the file. */
+        perror(filename);
+        quit(0);
+    }
+    job_end_phase();
+    elapsed = timestamp_ns() - t0;
+    monitor_stop();
+    for (i=0; i<capture.nslots; i++)
+        free_buffer(capture.slot[i].buf);
+    disk_close(capture.disk);
 
-            /* Read destination data. */
-            disk_read(dest, buf, n);
+    if (ferror(capture.hashes) | fclose(capture.hashes)) {
+        perror(hashes_name);
+        quit(0);
+    }
+    capture_save_bmap(bmap_name);
+    fclose(capture.ranges);
 
-            /* Compare. */
-            if (memcmp(buf, buf2, n) != 0) {
-                fprintf(stderr, "DATA ERROR!\n");
-                print_mismatch(buf, buf2, n,
-                    lseek(src, 0, SEEK_CUR) - n);
-                quit(0);
-            }
-            progress(progress_step);
-        }
-        printf(" done       \n");
+    printf("      Speed: %.1f MB/sec\n", elapsed ? capture.size * 1e3 / elapsed : 0);
+    printf("     Mapped: %.1f MB, %.0f%%\n", capture.mapped * CAPTURE_BLOCK / 1000000.0,
+        capture.mapped * 100.0 * CAPTURE_BLOCK / capture.size);
+    if (capture.compressor)
+        printf(" Compressed: %.1f MB by %s, checksum in %s.sha256\n",
+            capture.artifact_size / 1000000.0, capture.compressor->name,
+            capture.artifact);
+    printf("  Block map: %s\n", bmap_name);
+    printf("     Hashes: %s\n", hashes_name);
+    if (retry_count > 0) {
+        printf("    Retries: %u", retry_count);
+        if (reopen_count > 0)
+            printf(", device reopened %u times", reopen_count);
+        printf("\n");
+    }
+    if (print_stats) {
+        printf("\n    Latency:      count        p50        p90        p99        max\n");
+        print_latency(&hist_read);
     }
-    close(src);
-    disk_close(dest);
-    printf("      Speed: %.1f MB/sec\n",
-        nbytes / 1000.0 / mseconds_elapsed(&t0));
 }
 
 /*
@@ -714,60 +4809,232 @@ void write_image(const char *filename, int verify_only)
  */
 void usage()
 {
-    char *devices[MAXDEV + 1];
-    int ndev;
-
+    printf("SD image writer, Version %s\n", VERSION);
     printf("%s\n\n", copyright);
     printf("Usage:\n");
     printf("       sdwriter [-v] [-d device] sdcard.img\n");
+    printf("       sdwriter -l [--json]\n");
+    printf("       sdwriter --capture [--compress zstd|xz] [-d device] sdcard.img\n");
+    printf("       sdwriter --check-capacity [-d device] [sdcard.img]\n");
+    printf("       sdwriter --scan [--map FILE] [-d device]\n");
+    printf("       sdwriter --bench [--random] [--bench-size SIZE] [--destructive] [-d device]\n");
     printf("\nArgs:\n");
     printf("       sdcard.img          Binary file with SD card image\n");
     printf("       -v                  Verify only\n");
-    printf("       -d device           Use specified disk device\n");
+    printf("       -d device           Use specified disk device, or simulated target:\n");
+    printf("                           null:, file:path or sim:bw=40M,lat=2ms,stall=500ms/64M\n");
+    printf("       -l, --list          List available disk devices\n");
+    printf("       --json              Print device list in JSON format\n");
+    printf("       --min-rate MB       Refuse devices with links slower than MB/sec\n");
+    printf("       --no-unmount        Refuse to write to mounted device\n");
+    printf("       -s, --stats         Print latency statistics\n");
+    printf("       --series FILE       Save throughput time series to CSV or JSON file\n");
+    printf("       --progress-fd N     Report progress in JSON lines to file descriptor N\n");
+    printf("       --stall-ms N        Report requests slower than N msec (default 1000)\n");
+    printf("       --adapt             Reduce request size when the device stalls\n");
+    printf("       --flush-mb N        Flush writes every N megabytes (default 16, 0 - at end)\n");
+    printf("       --metrics FILE      Maintain Prometheus textfile with metrics\n");
+    printf("       --retries N         Retry failed requests N times (default 5)\n");
+    printf("       --retry-split       Retry failed requests by 64 kbyte pieces\n");
+    printf("       --resume[=verify]   Continue interrupted write from the journal,\n");
+    printf("                           optionally verifying the last written window\n");
+    printf("       --journal FILE      Checkpoint journal (default sdcard.img.<card>.journal)\n");
+    printf("       --capture           Read the card into image file, with block map\n");
+    printf("       --compress METHOD   Compress captured image by zstd or xz\n");
+    printf("       --check-capacity    Check for fake capacity, before writing if image given\n");
+    printf("       --scan              Read the whole device, show map of speed and errors\n");
+    printf("       --map FILE          Save the scan map to CSV file\n");
+    printf("       --bench             Measure throughput of the device\n");
+    printf("       --bench-size SIZE   Scratch region at the end of the disk (default 64M),\n");
+    printf("                           or 'all' for the whole disk\n");
+    printf("       --destructive       Do not save and restore the scratch region\n");
+    printf("       --random            Benchmark random 4K IOPS, for class A1/A2\n");
+    printf("       --qd N              Max queue depth of benchmark, scan or capture (default 32)\n");
+    printf("       --report FILE       Save benchmark results to JSON file\n");
     printf("       -D                  Debug mode\n");
     printf("       -h, --help          Print this help message\n");
     printf("       -V, --version       Print version\n");
     printf("\n");
 
-    get_devices(devices, MAXDEV);
-    if (! devices[0]) {
-        printf("No target disk devices available.\n");
-    } else {
-        printf("Available disk devices:\n\n");
-        for (ndev=0; devices[ndev]; ndev++) {
-            printf("        %s\n", devices[ndev]);
-        }
-    }
-    printf("\n");
+    print_devices();
     exit(0);
 }
 
 int main(int argc, char *argv[])
 {
+    enum {
+        OPT_JSON = 256,
+        OPT_MIN_RATE,
+        OPT_NO_UNMOUNT,
+        OPT_SERIES,
+        OPT_STALL_MS,
+        OPT_PROGRESS_FD,
+        OPT_ADAPT,
+        OPT_FLUSH_MB,
+        OPT_METRICS,
+        OPT_BENCH,
+        OPT_BENCH_SIZE,
+        OPT_DESTRUCTIVE,
+        OPT_REPORT,
+        OPT_RANDOM,
+        OPT_QD,
+        OPT_CHECK_CAPACITY,
+        OPT_SCAN,
+        OPT_MAP,
+        OPT_RESUME,
+        OPT_JOURNAL,
+        OPT_RETRIES,
+        OPT_RETRY_SPLIT,
+        OPT_CAPTURE,
+        OPT_COMPRESS,
+    };
     static const struct option long_options[] = {
         { "help",        0, 0, 'h' },
         { "version",     0, 0, 'V' },
+        { "list",        0, 0, 'l' },
+        { "json",        0, 0, OPT_JSON },
+        { "min-rate",    1, 0, OPT_MIN_RATE },
+        { "no-unmount",  0, 0, OPT_NO_UNMOUNT },
+        { "stats",       0, 0, 's' },
+        { "series",      1, 0, OPT_SERIES },
+        { "stall-ms",    1, 0, OPT_STALL_MS },
+        { "progress-fd", 1, 0, OPT_PROGRESS_FD },
+        { "adapt",       0, 0, OPT_ADAPT },
+        { "flush-mb",    1, 0, OPT_FLUSH_MB },
+        { "metrics",     1, 0, OPT_METRICS },
+        { "bench",       0, 0, OPT_BENCH },
+        { "bench-size",  1, 0, OPT_BENCH_SIZE },
+        { "destructive", 0, 0, OPT_DESTRUCTIVE },
+        { "report",      1, 0, OPT_REPORT },
+        { "random",      0, 0, OPT_RANDOM },
+        { "qd",          1, 0, OPT_QD },
+        { "check-capacity", 0, 0, OPT_CHECK_CAPACITY },
+        { "scan",        0, 0, OPT_SCAN },
+        { "map",         1, 0, OPT_MAP },
+        { "resume",      2, 0, OPT_RESUME },
+        { "journal",     1, 0, OPT_JOURNAL },
+        { "retries",     1, 0, OPT_RETRIES },
+        { "retry-split", 0, 0, OPT_RETRY_SPLIT },
+        { "capture",     0, 0, OPT_CAPTURE },
+        { "compress",    1, 0, OPT_COMPRESS },
         { NULL,          0, 0, 0 },
     };
     const char *filename;
     int ch;
 
-    printf("SD image writer, Version %s\n", VERSION);
     progname = argv[0];
+    kernels_init();
     setvbuf(stdout, NULL, _IOLBF, 0);
     setvbuf(stderr, NULL, _IOLBF, 0);
-    signal(SIGINT, interrupted);
+    catch_signal(SIGINT);
 #ifdef __linux__
-    signal(SIGHUP, interrupted);
+    catch_signal(SIGHUP);
 #endif
-    signal(SIGTERM, interrupted);
+    catch_signal(SIGTERM);
 
-    while ((ch = getopt_long(argc, argv, "vd:DhV", long_options, 0)) != -1)
+    while ((ch = getopt_long(argc, argv, "vd:lsDhV", long_options, 0)) != -1)
     {
         switch (ch) {
         case 'v':
             ++verify_only;
             continue;
+        case 'l':
+            ++list_only;
+            continue;
+        case 's':
+            ++print_stats;
+            continue;
+        case OPT_JSON:
+            ++json_output;
+            continue;
+        case OPT_MIN_RATE:
+            min_rate = strtod(optarg, 0);
+            continue;
+        case OPT_NO_UNMOUNT:
+            ++no_unmount;
+            continue;
+        case OPT_SERIES:
+            series_filename = optarg;
+            continue;
+        case OPT_STALL_MS:
+            stall_msec = strtoul(optarg, 0, 0);
+            continue;
+        case OPT_PROGRESS_FD:
+            progress_fd = strtoul(optarg, 0, 0);
+            continue;
+        case OPT_ADAPT:
+            ++adaptive;
+            continue;
+        case OPT_FLUSH_MB:
+            flush_interval = strtoull(optarg, 0, 0) * 1024 * 1024;
+            continue;
+        case OPT_METRICS:
+            metrics_filename = optarg;
+            continue;
+        case OPT_BENCH:
+            ++bench_mode;
+            continue;
+        case OPT_BENCH_SIZE:
+            if (strcmp(optarg, "all") == 0) {
+                bench_size = 0;
+            } else {
+                char *end;
+
+                bench_size = parse_size(optarg, &end);
+                if (*end != 0 || bench_size == 0) {
+                    fprintf(stderr, "%s: Bad benchmark size\n", optarg);
+                    quit(0);
+                }
+            }
+            continue;
+        case OPT_DESTRUCTIVE:
+            ++destructive;
+            continue;
+        case OPT_REPORT:
+            report_filename = optarg;
+            continue;
+        case OPT_RESUME:
+            ++resume_mode;
+            if (optarg && strcmp(optarg, "verify") == 0)
+                ++resume_verify;
+            else if (optarg)
+                usage();
+            continue;
+        case OPT_JOURNAL:
+            journal_filename = optarg;
+            continue;
+        case OPT_RETRIES:
+            retry_max = strtoul(optarg, 0, 0);
+            continue;
+        case OPT_RETRY_SPLIT:
+            ++retry_split;
+            continue;
+        case OPT_CAPTURE:
+            ++capture_mode;
+            continue;
+        case OPT_COMPRESS:
+            compress_method = optarg;
+            continue;
+        case OPT_SCAN:
+            ++scan_mode;
+            continue;
+        case OPT_MAP:
+            map_filename = optarg;
+            continue;
+        case OPT_CHECK_CAPACITY:
+            ++capacity_check;
+            continue;
+        case OPT_RANDOM:
+            ++bench_random;
+            continue;
+        case OPT_QD:
+            bench_qd = strtoul(optarg, 0, 0);
+            if (bench_qd < 1 || bench_qd > BENCH_MAX_QD) {
+                fprintf(stderr, "%s: Queue depth must be 1 to %u\n",
+                    optarg, BENCH_MAX_QD);
+                quit(0);
+            }
+            continue;
         case 'd':
             device_name = optarg;
             continue;
@@ -777,23 +5044,57 @@ int main(int argc, char *argv[])
         case 'h':
             break;
         case 'V':
-            /* Version already printed above. */
+            printf("SD image writer, Version %s\n", VERSION);
             return 0;
         }
         usage();
     }
     argc -= optind;
     argv += optind;
-    if (argc != 1)
+
+    if (list_only) {
+        /* Only print a list of devices, in a form suitable for scripts. */
+        if (json_output)
+            print_devices_json();
+        else
+            print_devices();
+        quit(1);
+    }
+    if (bench_mode || scan_mode ? argc != 0 : capacity_check ? argc > 1 : argc != 1)
         usage();
-    filename = argv[0];
+    filename = (argc > 0) ? argv[0] : 0;
+    if (bench_mode && bench_size == 0 && ! destructive) {
+        fprintf(stderr, "Benchmark of the whole disk needs --destructive option\n");
+        quit(0);
+    }
 
+    printf("SD image writer, Version %s\n", VERSION);
     printf("%s\n", copyright);
 
     if (! device_name)
         device_name = ask_device();
+    else if (disk_type(device_name) == DISK_DEVICE)
+        find_device(device_name, &target_info);
+
+    if (link_too_slow(&target_info)) {
+        char link[200];
+
+        describe_link(&target_info, link, sizeof(link));
+        fprintf(stderr, "%s: link %s is slower than %.1f MB/sec.\n",
+            device_name, link, min_rate);
+        quit(0);
+    }
 
-    write_image(filename, verify_only);
+    if (capacity_check && ! verify_only)
+        check_capacity();
+    if (scan_mode)
+        scan_device();
+    else if (bench_mode)
+        bench_device();
+    else if (capture_mode)
+        capture_image(filename);
+    else if (filename)
+        write_image(filename, verify_only);
 
     quit(1);
     return 0;